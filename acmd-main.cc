@@ -30,20 +30,41 @@
 #include "base.h"
 #include "automationstate.h"
 #include "http.h"
+#include "ingest.h"
 #include "mplayersession.h"
 #include "playableitem.h"
 #include "playlist.h"
 #include "requirementengine.h"
+#include "scanner.h"
 #include "playlist.pb.h"
 #include "protostore.h"
 
 DEFINE_string(bumpers, "unused", "bumpers - this is unused in this binary needed as a linking hack");
-DEFINE_string(command, "list", "Command to run - list, load, replace, append, dump, setup");
+DEFINE_string(command, "list", "Command to run - list, load, scan, replace, append, dump, setup");
 DEFINE_string(playlist, "default-playlist", "Target playlist");
 DEFINE_int32(weight, -1, "used with command=setup to set the weight");
+DEFINE_int32(batch_size, 1000, "Number of rows written per transaction by load and scan.");
+DEFINE_int32(load_threads, 0, "Number of files load works out the durations of at once; 0 for one "
+  "per core.");
+DEFINE_bool(load_in_order, true, "Print load's output in input order, rather than as each file is "
+  "stored.");
+DEFINE_string(root, "", "Directory scanned by command=scan");
+DEFINE_int32(scan_threads, 8, "Number of directories command=scan reads at once.");
 
 int shutdown_requested;
- 
+
+static int LoadThreads() {
+  return FLAGS_load_threads > 0 ? FLAGS_load_threads : boost::thread::hardware_concurrency();
+}
+
+// Prints one playlist exactly as it would appear within the DebugString of
+// an automation::Playlists holding every list.
+void PrintList(const automation::Playlist& list) {
+  automation::Playlists wrapper;
+  wrapper.add_item()->CopyFrom(list);
+  printf("%s", wrapper.DebugString().c_str());
+}
+
 int main(int argc, char **argv) {
   google::InitGoogleLogging(argv[0]);
   google::SetUsageMessage("Usage");
@@ -51,7 +72,8 @@ int main(int argc, char **argv) {
   google::InstallFailureSignalHandler();
   std::srand(time(NULL));
 
-  DatabaseHandle db(DatabaseOpen());
+  DatabaseHandle db(DatabaseHandle::WRITE);
+  MigrateSchema(db);
 
   PlaylistPtr null;
   AutomationState automation(db, NULL);
@@ -59,8 +81,9 @@ int main(int argc, char **argv) {
   Playlist candidate(db);
   candidate.Fetch(FLAGS_playlist);
   if (FLAGS_command == "list") {
-    printf("%s", Playlist::FetchAllLists(db).DebugString().c_str());
+    Playlist::VisitAllLists(db, boost::bind(&PrintList, _1));
   } else if (FLAGS_command == "load") {
+    Ingest ingest(db, FLAGS_batch_size, LoadThreads(), FLAGS_load_in_order, stdout);
     char buf[512];
     while (fgets(buf, sizeof(buf), stdin)) {
       if (buf[strlen(buf)-1] == '\n') {
@@ -69,18 +92,13 @@ int main(int argc, char **argv) {
       if (!strlen(buf)) {
         continue;
       }
-      PlayableItem item(db);
-      bool found = item.fetch(buf);
-      VLOG(30) << "found state " << found << " duration " << item.data().duration();
-      if (!found && item.data().duration() > 0) {
-        VLOG(5) << "Attempting to store";
-        item.Replace();
-      } else if (item.data().duration() <= 0) {
-        continue;
-      }
-
-      printf("%ld\t%s\n", item.data().playableitemid(), buf);
+      ingest.Add(buf);
     }
+    ingest.Finish();
+  } else if (FLAGS_command == "scan") {
+    Ingest ingest(db, FLAGS_batch_size, LoadThreads(), false, stdout);
+    Scanner scanner(db, FLAGS_scan_threads);
+    scanner.Scan(FLAGS_root, &ingest, stdout);
   } else if (FLAGS_command == "replace" || FLAGS_command == "append") {
     if (FLAGS_command == "replace") {
       candidate.mutable_data().clear_playableitemid();
@@ -95,7 +113,14 @@ int main(int argc, char **argv) {
       int itemid = atoi(buf);
       candidate.mutable_data().add_playableitemid(itemid);
     } 
-    candidate.Replace();
+    std::vector<automation::RowError> errors;
+    if (candidate.Replace(&errors) == SQLITE_CONSTRAINT) {
+      LOG(ERROR) << "Unable to save playlist " << FLAGS_playlist;
+    }
+    for (std::vector<automation::RowError>::iterator it = errors.begin(); it != errors.end(); ++it) {
+      LOG(ERROR) << "Unable to add item " << candidate.data().playableitemid(it->index) << " to "
+                 << FLAGS_playlist << ": " << it->message;
+    }
   } else if (FLAGS_command == "dump") {
     printf("%s",candidate.data().DebugString().c_str());
   } else if (FLAGS_command == "setup") {
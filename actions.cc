@@ -62,7 +62,8 @@ class PlayFilesCommand : public ScheduleCommand {
     AutomationState *as = AutomationState::get_state();
     MplayerSession& player = *CHECK_NOTNULL(as->get_player());
 
-    sqlite3 *db = DatabaseOpen();
+    // Playcounts and locks go through the WriteBehind, so reading is all we do here.
+    DatabaseHandle db(DatabaseHandle::READ);
     PlayableItem item(db);
 
     for (RepeatedPtrField<automation::PlayableItem>::const_iterator it = req.playlist().items().begin();
@@ -75,7 +76,6 @@ class PlayFilesCommand : public ScheduleCommand {
         player.Play(*it);
       }
     }
-    sqlite3_close(db);
   }
 };
 REGISTER_COMMAND(PlayFilesCommand);
@@ -86,7 +86,7 @@ class LegalIDCommand : public ScheduleCommand {
   void handle_command(const time_t &deadline, const automation::Requirement &command) {
     AutomationState *as = AutomationState::get_state();
     LOG(INFO) << "Playing ID";
-    sqlite3 *db = DatabaseOpen();
+    DatabaseHandle db(DatabaseHandle::READ);
     Playlist legalid(db);
     Playlist::LockByName(db, FLAGS_legalid);
     CHECK(legalid.FetchShuffled(FLAGS_legalid));
@@ -97,7 +97,6 @@ class LegalIDCommand : public ScheduleCommand {
       }
       legalid.PopWithTimelimit(FLAGS_legalid_max_length, &item);
     } while (!as->get_player()->Play(item));
-    sqlite3_close(db);
   }
 };
 REGISTER_COMMAND(LegalIDCommand);
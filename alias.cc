@@ -0,0 +1,71 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <glog/logging.h>
+#include "alias.h"
+
+void AliasTable::Build(const std::vector<double>& weights) {
+  probability_.clear();
+  alias_.clear();
+  double total = 0;
+  for (size_t i = 0; i < weights.size(); ++i) {
+    CHECK(weights[i] >= 0) << "Negative weight " << weights[i];
+    total += weights[i];
+  }
+  if (total <= 0) {
+    return;
+  }
+
+  // Scale so that the average column holds exactly 1, then top up each
+  // column that holds less from one that holds more.
+  size_t n = weights.size();
+  probability_.resize(n);
+  alias_.resize(n);
+  std::vector<size_t> small, large;
+  for (size_t i = 0; i < n; ++i) {
+    probability_[i] = weights[i] * n / total;
+    alias_[i] = i;
+    (probability_[i] < 1.0 ? small : large).push_back(i);
+  }
+  while (!small.empty() && !large.empty()) {
+    size_t less = small.back();
+    size_t more = large.back();
+    small.pop_back();
+    alias_[less] = more;
+    probability_[more] -= 1.0 - probability_[less];
+    if (probability_[more] < 1.0) {
+      large.pop_back();
+      small.push_back(more);
+    }
+  }
+  // Whatever is left over is 1 but for rounding.
+  for (size_t i = 0; i < small.size(); ++i) {
+    probability_[small[i]] = 1.0;
+  }
+  for (size_t i = 0; i < large.size(); ++i) {
+    probability_[large[i]] = 1.0;
+  }
+}
+
+size_t AliasTable::Sample(double u) const {
+  CHECK(!empty());
+  double scaled = u * alias_.size();
+  size_t column = static_cast<size_t>(scaled);
+  if (column >= alias_.size()) {
+    column = alias_.size() - 1;
+  }
+  return (scaled - column < probability_[column]) ? column : alias_[column];
+}
@@ -0,0 +1,39 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef ALIAS_H
+#define ALIAS_H
+
+#include <stddef.h>
+#include <vector>
+
+// An alias table (Vose's method) over a set of weights: once built, in
+// O(n), it draws index i with probability weights[i] / sum(weights) in
+// constant time.
+class AliasTable {
+ public:
+  // Weights must not be negative; if they are all zero, the table is empty.
+  void Build(const std::vector<double>& weights);
+  bool empty() const { return alias_.empty(); }
+
+  // u is uniform in [0, 1).
+  size_t Sample(double u) const;
+
+ private:
+  std::vector<double> probability_;  // Of keeping column i rather than its alias.
+  std::vector<size_t> alias_;
+};
+
+#endif
@@ -14,7 +14,9 @@
  *   limitations under the License.
  */
 #include <algorithm>
+#include <boost/algorithm/string.hpp>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <fstream>
 #include <glog/logging.h>
 #include <gflags/gflags.h>
@@ -29,11 +31,14 @@
 #include "db.h"
 #include "base.h"
 #include "automationstate.h"
+#include "catalog.h"
 #include "http.h"
+#include "librarywatcher.h"
 #include "mplayersession.h"
 #include "playableitem.h"
 #include "playlist.h"
 #include "requirementengine.h"
+#include "writebehind.h"
 
 DEFINE_string(bumpers, "", "Name of playlist which contains bumpers.  If empty, use all playableitems instead.");
 DEFINE_bool(webapi, true, "If false, do not setup a web backend.");
@@ -50,7 +55,13 @@ DEFINE_string(ssl_key, "", "If set, path to our SSL host key. (PEM-encoded)");
 DEFINE_int32(threadcount, 8, "Number of threads to have available for HTTP requests. Set this above 50 at your own peril.");
 DEFINE_string(interface, "127.0.0.1", "IP of interface to listen on");
 DEFINE_bool(doinit, true, "If true, we play commands marked @reboot on startup, pre-webserver standup.");
-DEFINE_bool(fast_shutdown, false, "If true, shutdown immediately on exit request. "
+DEFINE_int32(db_readers, 4, "Number of read-only database connections kept open for web requests and schedule actions.");
+DEFINE_int32(writebehind_capacity, 1000, "Number of distinct playcount and playlist lock writes that may be "
+                                         "waiting on the database before playout blocks on them.");
+DEFINE_string(watch, "", "Comma-separated list of directories to watch, adding files to the library "
+                        "as they appear and change, and passing over those that are deleted.");
+DEFINE_bool(fast_shutdown, false, "If true, shutdown immediately on exit request, dropping any "
+                                  "background writes not yet made. "
                                   "Otherwise, attempt to defer shutdown until after the track ends.");
 
 int shutdown_requested = 0;
@@ -106,9 +117,21 @@ int main(int argc, char **argv) {
   sqlite3 *db;
 
   db = DatabaseOpen();
+  // Not the only writer; see ConnectionPool.
+  sqlite3_busy_timeout(db, 5000);
+  MigrateSchema(db);
   if (sqlite3_exec(db, "DELETE FROM PlaylistLock;", NULL, NULL, NULL) != SQLITE_OK) {
     LOG(WARNING) << "Unable to truncate locked playlist list.";
   }
+  WriteBehind writer(DatabaseOpen(), FLAGS_writebehind_capacity);
+  ConnectionPool pool(FLAGS_db_readers);
+  Catalog::get()->PollForChanges();
+  boost::scoped_ptr<LibraryWatcher> watcher;
+  if (!FLAGS_watch.empty()) {
+    std::vector<std::string> roots;
+    boost::split(roots, FLAGS_watch, boost::is_any_of(","));
+    watcher.reset(new LibraryWatcher(DatabaseOpen(), roots));
+  }
 
   WebAPI::ReadFromDatabase(db);
   MplayerSession mp;
@@ -22,6 +22,7 @@
 #include <gflags/gflags.h>
 #include "requirementengine.h"
 #include "mplayersession.h"
+#include "writebehind.h"
 
 DEFINE_bool(defaulthuman, false, "If true, when automation starts a human is in control.");
 DEFINE_int32(bumpercutoff, 200, "If we have <= bumpercutoff seconds remaining after we have "
@@ -31,6 +32,8 @@ DEFINE_int32(sleepcutoff, 4, "If we have <= sleepcutoff seconds remaining after
   "exhausted our options with mainshow, override, and bumperlist [assuming sleepcutoff < bumpercutoff]"
   " playlists, we can sleep for the remainder of time.  This value => max amount of dead air "
   "we'll intentionally generate.");
+DEFINE_int32(bumper_refresh, 3600, "Seconds between full reloads of the bumpers, to pick up new "
+  "items; in between, bumpers that have been played are simply put back.");
 
 DECLARE_string(bumpers);
 
@@ -44,7 +47,8 @@ AutomationState::AutomationState(sqlite3* db, MplayerSession* player) :
   override_(FLAGS_defaulthuman),
   override_playlist_(new Playlist(db)),
   mainshow_(new Playlist(db)),
-  bumperlist_(new Playlist(db)) {
+  bumperlist_(new Playlist(db)),
+  bumpers_loaded_(0) {
 
   player_ = main_player_;
   bumperlist_->NeverSave();
@@ -77,8 +81,7 @@ bool AutomationState::RunOnce() {
 
   if (time(NULL) >= deadline) {
     re_->RunBlock(deadline, &next_requirements);
-    // We're doing this needlessly most of the time.  We only need to do this if we
-    // played bumpers...
+    // Cheap: only the bumpers played since the last reset are put back.
     ResetBumpers();
     return true;
   }
@@ -89,6 +92,10 @@ bool AutomationState::RunOnce() {
   MplayerSession &mp = *CHECK_NOTNULL(get_player());
   if (next_track.data().has_filename()) {
     // We found something in our mainshow_ that fits in the alloted time; play it.
+    if (!Playable(next_track)) {
+      return true;
+    }
+    LookAhead(deadline, gap, next_track.data().duration(), next_requirements);
     mp.Play(next_track);
     return true;
   } else {
@@ -104,16 +111,27 @@ bool AutomationState::RunOnce() {
       SetMainshow();
       return false;
     } else {
-      bumperlist_->PopWithTimelimit(deadline - time(NULL) + gap, &next_bumper);
+      // Work out the fewest bumpers that bring us to the deadline (early by
+      // no more than we'd sleep, late by no more than the gap), and play the
+      // first.  Failing that, play whatever fits.
+      int time_left = deadline - time(NULL);
+      bumperlist_->PopToFill(time_left - FLAGS_sleepcutoff, time_left, time_left + gap, &next_bumper);
+      if (!next_bumper.data().has_filename()) {
+        bumperlist_->PopWithTimelimit(deadline - time(NULL) + gap, &next_bumper);
+      }
       if (next_bumper.data().has_filename()) {
         // We found a bumper to play.  Play it.
+        if (!Playable(next_bumper)) {
+          return true;
+        }
+        LookAhead(deadline, gap, next_bumper.data().duration(), next_requirements);
         mp.Play(next_bumper);
         return true;
       }
 
       // We have no bumpers left.  Let's check one time to see if we still
       // have time to kill...
-      int time_left = deadline - time(NULL);
+      time_left = deadline - time(NULL);
       if(time_left <= 0) {
         return true;
       }
@@ -150,6 +168,10 @@ bool AutomationState::ManualOverride() {
       // codepath) perhaps incorrectly here.  I don't think this is a concern.
       usleep(500);
       if (shutdown_requested) {
+        // exit() skips the WriteBehind's destructor.
+        if (WriteBehind::get()) {
+          WriteBehind::get()->Flush(boost::posix_time::seconds(10));
+        }
         exit(0);
       }
     }
@@ -177,6 +199,13 @@ PlaylistPtr AutomationState::GetMainshow() {
   return mainshow_;
 }
 void AutomationState::ResetBumpers() {
+  // Putting back the bumpers we've played is enough, unless it's time to
+  // pick up changes to the library (or the bumpers playlist).
+  if (bumpers_loaded_ && time(NULL) - bumpers_loaded_ < FLAGS_bumper_refresh) {
+    int restored = bumperlist_->Restore();
+    VLOG(5) << "Restored " << restored << " bumpers";
+    return;
+  }
   VLOG(5) << "Reloading bumpers";
   if (FLAGS_bumpers.empty()) {
     bumperlist_->FetchSuperlist(LLONG_MAX, 0);
@@ -184,4 +213,45 @@ void AutomationState::ResetBumpers() {
     Playlist::LockByName(db_, FLAGS_bumpers);
     bumperlist_->Fetch(FLAGS_bumpers);
   }
+  bumpers_loaded_ = time(NULL);
 } 
+
+// Guesses what we'll play once the next playing_for seconds are up, from
+// the time that will be left then, and has its file warmed in the meantime.
+// It's only a guess: RunOnce chooses afresh when the time comes, so a
+// change to the schedule or the playlists just means a cold start.
+void AutomationState::LookAhead(time_t deadline, time_t gap, sqlite3_int64 playing_for,
+                                const automation::Schedule& next_requirements) {
+  int time_left = deadline - time(NULL) - playing_for;
+  PlayableItem next(db_);
+  if (time_left <= 0) {
+    // The requirement will be due; the first file it plays, if any.
+    for (int i = 0; i < next_requirements.schedule_size(); ++i) {
+      const automation::Requirement& requirement = next_requirements.schedule(i);
+      if (requirement.type() == automation::Requirement::PLAY_FILES &&
+          requirement.playlist().items_size()) {
+        next.CopyFrom(requirement.playlist().items(0));
+        break;
+      }
+    }
+  } else {
+    GetMainshow()->PeekWithTimelimit(time_left + gap, &next);
+    if (!next.data().has_filename() && time_left < FLAGS_bumpercutoff) {
+      bumperlist_->PeekWithTimelimit(time_left + gap, &next);
+    }
+  }
+  if (next.data().has_filename() && next.data().type() != automation::PlayableItem::WEBSTREAM) {
+    readahead_.Warm(next.data().filename());
+  }
+}
+
+// False (and we skip it) if the lookahead found item's file missing and it
+// still is.
+bool AutomationState::Playable(PlayableItem &item) {
+  const std::string& filename = item.data().filename();
+  if (readahead_.Unreadable(filename) && !Readahead::WarmFile(filename)) {
+    LOG(ERROR) << "Skipping " << filename << ", which is unreadable.";
+    return false;
+  }
+  return true;
+}
@@ -20,6 +20,8 @@
 #include "base.h"
 #include "playlist.h"
 #include "mplayersession.h"
+#include "readahead.h"
+#include "requirement.pb.h"
 #include <string>
 #include <boost/shared_ptr.hpp>
 
@@ -73,6 +75,9 @@ class AutomationState {
   PlaylistPtr GetMainshow();
  private:
   void ResetBumpers();
+  void LookAhead(time_t deadline, time_t gap, sqlite3_int64 playing_for,
+                 const automation::Schedule& next_requirements);
+  bool Playable(PlayableItem &item);
   DISALLOW_COPY_AND_ASSIGN(AutomationState);
   bool ManualOverride();
 
@@ -87,6 +92,8 @@ class AutomationState {
   PlaylistPtr const override_playlist_;
   PlaylistPtr const mainshow_;
   PlaylistPtr const bumperlist_;
+  time_t bumpers_loaded_;  // When bumperlist_ was last reloaded in full; 0 if never.
+  Readahead readahead_;
 };
  
 
@@ -0,0 +1,324 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <limits.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include "catalog.h"
+#include "db.h"
+#include "protostore.h"
+
+DEFINE_int32(catalog_poll_secs, 30, "Seconds between checks for changes made to the library by "
+  "other processes (acmd load and scan, say), which then reload the catalog; 0 never to check.");
+
+Catalog *Catalog::get() {
+  static Catalog instance;
+  return &instance;
+}
+
+Catalog::Catalog() : loaded_(false), reloading_(false), reload_again_(false) {
+  automation::MessageStore::SetWriteObserver(automation::PlayableItem::descriptor(), this);
+}
+
+bool Catalog::Duration(sqlite3 *db, sqlite3_int64 id, sqlite3_int64 *duration) {
+  return Get(db, id, NULL, duration, NULL);
+}
+
+bool Catalog::Playcount(sqlite3 *db, sqlite3_int64 id, int *playcount) {
+  return Get(db, id, NULL, NULL, playcount);
+}
+
+bool Catalog::Lookup(sqlite3 *db, sqlite3_int64 id, automation::PlayableItem *item) {
+  item->Clear();
+  return Get(db, id, item, NULL, NULL);
+}
+
+// Fills in whichever of item, duration and playcount are given.  Lookups of
+// items we already hold share the lock; only loading needs it to itself.
+bool Catalog::Get(sqlite3 *db, sqlite3_int64 id, automation::PlayableItem *item,
+                  sqlite3_int64 *duration, int *playcount) {
+  {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    if (items_.missing.count(id)) {
+      return false;
+    }
+    if (loaded_) {
+      std::map<sqlite3_int64, int>::const_iterator it = items_.slots.find(id);
+      if (it != items_.slots.end()) {
+        CopyLocked(it->second, item, duration, playcount);
+        return true;
+      }
+    }
+  }
+  boost::unique_lock<boost::shared_mutex> lock(mutex_);
+  // Until the first load, nothing is known to be missing.
+  int slot = loaded_ && items_.missing.count(id) ? -1 : SlotLocked(db, id);
+  if (slot < 0 || items_.missing.count(id)) {
+    return false;
+  }
+  CopyLocked(slot, item, duration, playcount);
+  return true;
+}
+
+void Catalog::CopyLocked(int slot, automation::PlayableItem *item,
+                         sqlite3_int64 *duration, int *playcount) const {
+  if (item) {
+    item->set_playableitemid(items_.ids[slot]);
+    item->set_filename(items_.filenames[slot]);
+    item->set_duration(items_.durations[slot]);
+    item->set_description(items_.descriptions[slot]);
+    item->set_playcount(items_.playcounts[slot]);
+  }
+  if (duration) {
+    *duration = items_.durations[slot];
+  }
+  if (playcount) {
+    *playcount = items_.playcounts[slot];
+  }
+}
+
+void Catalog::AddPlaycount(sqlite3_int64 id, int count) {
+  boost::unique_lock<boost::shared_mutex> lock(mutex_);
+  TouchedLocked(id);
+  std::map<sqlite3_int64, int>::iterator it = items_.slots.find(id);
+  if (it != items_.slots.end()) {
+    items_.playcounts[it->second] += count;
+  }
+}
+
+void Catalog::Invalidate() {
+  boost::unique_lock<boost::shared_mutex> lock(mutex_);
+  if (!loaded_) {
+    return;  // The first lookup reads everything anyway.
+  }
+  if (reloading_) {
+    reload_again_ = true;
+    return;
+  }
+  reloading_ = true;
+  touched_.clear();
+  boost::thread(boost::bind(&Catalog::Reload, this)).detach();
+}
+
+// Reads the table into a fresh copy, without holding mutex_, and swaps it
+// in.  Anything written meanwhile is dropped from the copy, to be read
+// again on demand, since the copy may have been read before the write.
+void Catalog::Reload() {
+  while (true) {
+    Items items;
+    {
+      DatabaseHandle db(DatabaseHandle::READ);
+      items.Load(db);
+    }
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    for (std::set<sqlite3_int64>::iterator it = touched_.begin(); it != touched_.end(); ++it) {
+      items.slots.erase(*it);
+      if (items_.missing.count(*it)) {
+        items.missing.insert(*it);
+      } else {
+        items.missing.erase(*it);
+      }
+    }
+    touched_.clear();
+    items_.swap(items);
+    VLOG(1) << "Catalog reloaded " << items_.ids.size() << " items";
+    if (!reload_again_) {
+      reloading_ = false;
+      return;
+    }
+    reload_again_ = false;
+  }
+}
+
+void Catalog::PollForChanges() {
+  if (FLAGS_catalog_poll_secs > 0) {
+    boost::thread(boost::bind(&Catalog::Poll, this)).detach();
+  }
+}
+
+// PRAGMA data_version changes whenever another connection, in this process
+// or any other, commits to the database.  It is per connection, so this
+// keeps one of its own.  Our own writes bump it too, and cost a reload at
+// most once a poll.
+static int DataVersion(sqlite3 *db) {
+  sqlite3_stmt *ps;
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &ps, NULL)) << sqlite3_errmsg(db);
+  int version = sqlite3_step(ps) == SQLITE_ROW ? sqlite3_column_int(ps, 0) : -1;
+  sqlite3_finalize(ps);
+  return version;
+}
+
+void Catalog::Poll() {
+  sqlite3 *db = DatabaseOpen();
+  sqlite3_busy_timeout(db, 5000);
+  int version = DataVersion(db);
+  while (true) {
+    boost::this_thread::sleep(boost::posix_time::seconds(FLAGS_catalog_poll_secs));
+    int now = DataVersion(db);
+    if (now != version) {
+      VLOG(1) << "Database changed; reloading the catalog";
+      version = now;
+      Invalidate();
+    }
+  }
+}
+
+void Catalog::SetMissing(sqlite3 *db, sqlite3_int64 id, bool missing) {
+  sqlite3_stmt *ps;
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db, missing ?
+      "INSERT OR IGNORE INTO MissingItem (PlayableItemID) VALUES (?)" :
+      "DELETE FROM MissingItem WHERE PlayableItemID = ?",
+      -1, &ps, NULL)) << sqlite3_errmsg(db);
+  sqlite3_bind_int64(ps, 1, id);
+  if (sqlite3_step(ps) != SQLITE_DONE) {
+    LOG(WARNING) << "Unable to record item " << id << " as " << (missing ? "missing" : "present")
+                 << ": " << sqlite3_errmsg(db);
+  }
+  sqlite3_finalize(ps);
+
+  boost::unique_lock<boost::shared_mutex> lock(mutex_);
+  TouchedLocked(id);
+  if (missing) {
+    items_.missing.insert(id);
+  } else {
+    items_.missing.erase(id);
+  }
+}
+
+bool Catalog::FileGone(sqlite3 *db, sqlite3_int64 id, const std::string& filename) {
+  std::string copy;
+  sqlite3_stmt *ps;
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db,
+      "SELECT filename FROM FileFingerprint WHERE PlayableItemID = ?1",
+      -1, &ps, NULL)) << sqlite3_errmsg(db);
+  sqlite3_bind_int64(ps, 1, id);
+  while (copy.empty() && sqlite3_step(ps) == SQLITE_ROW) {
+    const char *other = reinterpret_cast<const char *>(sqlite3_column_text(ps, 0));
+    if (other && other != filename && !access(other, F_OK)) {
+      copy = other;
+    }
+  }
+  sqlite3_finalize(ps);
+  if (copy.empty()) {
+    SetMissing(db, id, true);
+    LOG(WARNING) << "Library item " << id << " is gone: " << filename;
+    return true;
+  }
+
+  std::vector<automation::PlayableItem> items(1);
+  items[0].set_playableitemid(id);
+  items[0].set_filename(copy);
+  std::vector<automation::RowError> errors;
+  automation::ProtoStore<automation::PlayableItem> store(db);
+  store.UpdateBatch(items.begin(), items.end(), &errors);
+  if (!errors.empty()) {
+    LOG(WARNING) << "Unable to move item " << id << " to " << copy << ": " << errors[0].message;
+  } else {
+    LOG(INFO) << "Library item " << id << " is gone from " << filename << ", but is still " << copy;
+  }
+  return false;
+}
+
+void Catalog::RowWritten(const google::protobuf::Message& row) {
+  const automation::PlayableItem& item = static_cast<const automation::PlayableItem&>(row);
+  boost::unique_lock<boost::shared_mutex> lock(mutex_);
+  if (!loaded_ || !item.has_playableitemid()) {
+    return;
+  }
+  TouchedLocked(item.playableitemid());
+  if (item.has_filename() && item.has_duration() && item.has_description() && item.has_playcount()) {
+    items_.Store(item);
+  } else {
+    // Partial updates leave the other columns as they were, and REPLACE
+    // nulls them; rather than guess which, read the row again when needed.
+    items_.slots.erase(item.playableitemid());
+  }
+}
+
+void Catalog::TouchedLocked(sqlite3_int64 id) {
+  if (reloading_) {
+    touched_.insert(id);
+  }
+}
+
+// The slot holding id, loading it (or, the first time, everything) if need
+// be; -1 if there is no such item.
+int Catalog::SlotLocked(sqlite3 *db, sqlite3_int64 id) {
+  if (!loaded_) {
+    items_.Load(db);
+    loaded_ = true;
+    VLOG(1) << "Catalog loaded " << items_.ids.size() << " items";
+  }
+  std::map<sqlite3_int64, int>::iterator it = items_.slots.find(id);
+  if (it != items_.slots.end()) {
+    return it->second;
+  }
+  automation::ProtoStore<automation::PlayableItem> store(db);
+  automation::PlayableItem item;
+  if (!store.LoadById(&item, id)) {
+    return -1;
+  }
+  items_.Store(item);
+  return items_.slots[id];
+}
+
+void Catalog::Items::Load(sqlite3 *db) {
+  Items empty;
+  swap(empty);
+  automation::ProtoStore<automation::PlayableItem> store(db);
+  automation::ProtoStore<automation::PlayableItem>::Cursor cursor(&store, LLONG_MAX, 0);
+  while (cursor.Next()) {
+    Store(cursor.row());
+  }
+  sqlite3_stmt *ps;
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db, "SELECT PlayableItemID FROM MissingItem", -1, &ps, NULL))
+      << sqlite3_errmsg(db);
+  while (sqlite3_step(ps) == SQLITE_ROW) {
+    missing.insert(sqlite3_column_int64(ps, 0));
+  }
+  sqlite3_finalize(ps);
+}
+
+void Catalog::Items::Store(const automation::PlayableItem& item) {
+  std::map<sqlite3_int64, int>::iterator it = slots.find(item.playableitemid());
+  if (it == slots.end()) {
+    slots[item.playableitemid()] = ids.size();
+    ids.push_back(item.playableitemid());
+    durations.push_back(item.duration());
+    playcounts.push_back(item.playcount());
+    filenames.push_back(item.filename());
+    descriptions.push_back(item.description());
+    return;
+  }
+  int slot = it->second;
+  durations[slot] = item.duration();
+  playcounts[slot] = item.playcount();
+  filenames[slot] = item.filename();
+  descriptions[slot] = item.description();
+}
+
+void Catalog::Items::swap(Items& other) {
+  slots.swap(other.slots);
+  ids.swap(other.ids);
+  durations.swap(other.durations);
+  playcounts.swap(other.playcounts);
+  filenames.swap(other.filenames);
+  descriptions.swap(other.descriptions);
+  missing.swap(other.missing);
+}
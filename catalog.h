@@ -0,0 +1,121 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <time.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "base.h"
+#include "messagestore.h"
+#include "playableitem.pb.h"
+#include "sqlite3.h"
+
+// Catalog is an in-memory copy of the PlayableItem table, so that choosing
+// from a playlist doesn't cost a query per candidate.  It is read in full
+// the first time it's needed and kept current by watching writes made
+// through MessageStore.  Items it hasn't seen yet (added by acmd, say) are
+// fetched from the database on demand.  Invalidate() reads the table again
+// on a thread of its own, and swaps the copy in when it is done, so that
+// lookups meanwhile carry on against the old one.  Changes made by other
+// processes (acmd load and scan) to items it already holds are only seen
+// once something invalidates it; PollForChanges() does so whenever the
+// database changes.
+//
+// Each column is held in an array of its own, so that scanning durations
+// touches only durations.
+class Catalog : public automation::WriteObserver {
+ public:
+  static Catalog *get();
+
+  // Both return false if there is no such item.  db is used only when the
+  // catalog has to (re)load.
+  bool Duration(sqlite3 *db, sqlite3_int64 id, sqlite3_int64 *duration);
+  bool Playcount(sqlite3 *db, sqlite3_int64 id, int *playcount);
+  bool Lookup(sqlite3 *db, sqlite3_int64 id, automation::PlayableItem *item);
+
+  // For writes that bypass MessageStore.
+  void AddPlaycount(sqlite3_int64 id, int count);
+  // For writes that might have changed anything; see above.
+  void Invalidate();
+  // Starts a thread that calls Invalidate() every --catalog_poll_secs in
+  // which the database has been written to.  Only the daemon, which holds
+  // the catalog for its lifetime, needs this.
+  void PollForChanges();
+
+  // An item whose file is known to be gone (see LibraryWatcher) is treated
+  // as if it weren't there at all, so nothing chooses it, until its file
+  // comes back.  The mark is kept in MissingItem, written through db, so
+  // that it survives restarts and other processes see it when they reload.
+  void SetMissing(sqlite3 *db, sqlite3_int64 id, bool missing);
+  // For when filename, a file of item id, has gone: if FileFingerprint
+  // knows of another file of the item (a copy; see Ingest::Identify) that
+  // is still there, the item moves to it, and otherwise is marked missing.
+  // Returns true if it was marked missing.
+  bool FileGone(sqlite3 *db, sqlite3_int64 id, const std::string& filename);
+
+  void RowWritten(const google::protobuf::Message& row);
+
+ private:
+  // Each column is indexed by slot.
+  struct Items {
+    std::map<sqlite3_int64, int> slots;  // PlayableItemID to slot.
+    std::vector<sqlite3_int64> ids;
+    std::vector<sqlite3_int64> durations;
+    std::vector<int> playcounts;
+    std::vector<std::string> filenames;
+    std::vector<std::string> descriptions;
+    std::set<sqlite3_int64> missing;     // Whether or not they have slots.
+
+    void Load(sqlite3 *db);
+    // Overwrites item's slot in place, or appends one.  Slots dropped by
+    // RowWritten are only reclaimed by the next full load.
+    void Store(const automation::PlayableItem& item);
+    void swap(Items& other);
+  };
+
+  Catalog();
+
+  bool Get(sqlite3 *db, sqlite3_int64 id, automation::PlayableItem *item,
+           sqlite3_int64 *duration, int *playcount);
+  void Reload();
+  void Poll();
+
+  // These require mutex_ (held exclusively, if they change anything).
+  void CopyLocked(int slot, automation::PlayableItem *item,
+                  sqlite3_int64 *duration, int *playcount) const;
+  int SlotLocked(sqlite3 *db, sqlite3_int64 id);
+  void TouchedLocked(sqlite3_int64 id);
+
+  // mutex_ guards everything below.  Lookups, which are most of the
+  // traffic and come from every filter thread at once, share it.
+  boost::shared_mutex mutex_;
+  bool loaded_;
+  Items items_;
+  // While Reload runs: items written since it started, which its copy may
+  // predate, and whether to start again once it's done.
+  bool reloading_;
+  bool reload_again_;
+  std::set<sqlite3_int64> touched_;
+
+  DISALLOW_COPY_AND_ASSIGN(Catalog);
+};
+
+#endif
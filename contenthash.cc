@@ -0,0 +1,185 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <vector>
+#include <glog/logging.h>
+#include "contenthash.h"
+
+namespace {
+
+const off_t kWholeFileLimit = 1 << 20;
+const int kSampledBlocks = 16;
+const size_t kBlockSize = 16 << 10;
+
+const uint64_t kPrime1 = 11400714785074694791ULL;
+const uint64_t kPrime2 = 14029467366897019727ULL;
+const uint64_t kPrime3 = 1609587929392839161ULL;
+const uint64_t kPrime4 = 9650029242287828579ULL;
+const uint64_t kPrime5 = 2870177450012600261ULL;
+
+uint64_t Rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+uint64_t Le64(const unsigned char *p) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+uint64_t Round(uint64_t acc, uint64_t input) {
+  return Rotl(acc + input * kPrime2, 31) * kPrime1;
+}
+
+uint64_t Merge(uint64_t acc, uint64_t v) {
+  return (acc ^ Round(0, v)) * kPrime1 + kPrime4;
+}
+
+// XXH64, as specified at https://github.com/Cyan4973/xxHash.  No bytes with
+// seed 0 hash to 0xef46db3751d8e999, and "a" to 0xd24ec4f1a98c6e5b.
+uint64_t XxHash64(const unsigned char *p, size_t length, uint64_t seed) {
+  const unsigned char *end = p + length;
+  uint64_t h;
+  if (length >= 32) {
+    uint64_t v1 = seed + kPrime1 + kPrime2;
+    uint64_t v2 = seed + kPrime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - kPrime1;
+    for (; end - p >= 32; p += 32) {
+      v1 = Round(v1, Le64(p));
+      v2 = Round(v2, Le64(p + 8));
+      v3 = Round(v3, Le64(p + 16));
+      v4 = Round(v4, Le64(p + 24));
+    }
+    h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+    h = Merge(Merge(Merge(Merge(h, v1), v2), v3), v4);
+  } else {
+    h = seed + kPrime5;
+  }
+  h += length;
+  for (; end - p >= 8; p += 8) {
+    h = Rotl(h ^ Round(0, Le64(p)), 27) * kPrime1 + kPrime4;
+  }
+  if (end - p >= 4) {
+    uint64_t word = p[0] | (p[1] << 8) | (p[2] << 16) | (uint64_t(p[3]) << 24);
+    h = Rotl(h ^ (word * kPrime1), 23) * kPrime2 + kPrime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h = Rotl(h ^ (*p * kPrime5), 11) * kPrime1;
+  }
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h;
+}
+
+bool ReadFully(int fd, unsigned char *buf, size_t length, off_t offset) {
+  while (length) {
+    ssize_t got = pread(fd, buf, length, offset);
+    if (got <= 0) {
+      return false;
+    }
+    buf += got;
+    length -= got;
+    offset += got;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool ContentHash(const std::string& filename, sqlite3_int64 *hash) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat info;
+  std::vector<unsigned char> data;
+  bool read = !fstat(fd, &info);
+  if (read && info.st_size <= kWholeFileLimit) {
+    data.resize(info.st_size);
+    read = data.empty() || ReadFully(fd, &data[0], data.size(), 0);
+  } else if (read) {
+    data.resize(kSampledBlocks * kBlockSize);
+    off_t stride = (info.st_size - kBlockSize) / (kSampledBlocks - 1);
+    for (int i = 0; read && i < kSampledBlocks; ++i) {
+      read = ReadFully(fd, &data[i * kBlockSize], kBlockSize, i * stride);
+    }
+  }
+  close(fd);
+  if (!read) {
+    return false;
+  }
+  *hash = XxHash64(data.empty() ? NULL : &data[0], data.size(), info.st_size);
+  return true;
+}
+
+bool SameContent(const std::string& a, const std::string& b) {
+  int fd_a = open(a.c_str(), O_RDONLY);
+  int fd_b = open(b.c_str(), O_RDONLY);
+  struct stat info_a, info_b;
+  bool same = fd_a != -1 && fd_b != -1 && !fstat(fd_a, &info_a) && !fstat(fd_b, &info_b) &&
+              info_a.st_size == info_b.st_size;
+  std::vector<unsigned char> buf_a(kBlockSize * 4), buf_b(kBlockSize * 4);
+  for (off_t offset = 0; same && offset < info_a.st_size; offset += buf_a.size()) {
+    size_t length = std::min<off_t>(buf_a.size(), info_a.st_size - offset);
+    same = ReadFully(fd_a, &buf_a[0], length, offset) && ReadFully(fd_b, &buf_b[0], length, offset) &&
+           !memcmp(&buf_a[0], &buf_b[0], length);
+  }
+  if (fd_a != -1) {
+    close(fd_a);
+  }
+  if (fd_b != -1) {
+    close(fd_b);
+  }
+  return same;
+}
+
+ContentIndex::ContentIndex(sqlite3 *db) : db_(CHECK_NOTNULL(db)), find_(NULL) {
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_,
+      "SELECT PlayableItemID, filename, duration FROM PlayableItem "
+      "  WHERE contenthash = ? AND duration > 0 ORDER BY PlayableItemID LIMIT 1",
+      -1, &find_, NULL)) << sqlite3_errmsg(db_);
+}
+
+ContentIndex::~ContentIndex() {
+  sqlite3_finalize(find_);
+}
+
+bool ContentIndex::Find(sqlite3_int64 hash, automation::PlayableItem *item) {
+  sqlite3_bind_int64(find_, 1, hash);
+  bool found = sqlite3_step(find_) == SQLITE_ROW;
+  if (found) {
+    const char *filename = reinterpret_cast<const char *>(sqlite3_column_text(find_, 1));
+    item->set_playableitemid(sqlite3_column_int64(find_, 0));
+    item->set_filename(filename ? filename : "");
+    item->set_duration(sqlite3_column_int64(find_, 2));
+  }
+  sqlite3_reset(find_);
+  return found;
+}
@@ -0,0 +1,55 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef CONTENTHASH_H
+#define CONTENTHASH_H
+
+#include <string>
+#include "base.h"
+#include "playableitem.pb.h"
+#include "sqlite3.h"
+
+// Hashes what is in the file at filename (xxHash64, seeded with its size)
+// so that a copy of a file already in the library can be found without
+// probing it.  Files up to a megabyte are hashed whole; of a longer one,
+// only sixteen evenly spaced 16k blocks are read, the first and last among
+// them.  Two files that differ only elsewhere hash the same, so a match is
+// just a candidate, to be confirmed (with SameContent, say) before anything
+// relies on it.  Returns false if the file can't be read.
+bool ContentHash(const std::string& filename, sqlite3_int64 *hash);
+
+// True if the files at a and b can both be read and hold the same bytes.
+bool SameContent(const std::string& a, const std::string& b);
+
+// Finds library items by content hash (contentdex).  Each ContentIndex has
+// a statement of its own, so one may be used per thread over a shared
+// connection.
+class ContentIndex {
+ public:
+  explicit ContentIndex(sqlite3 *db);
+  ~ContentIndex();
+
+  // Fills in the ID, filename and duration of the first playable item with
+  // hash, if there is one.
+  bool Find(sqlite3_int64 hash, automation::PlayableItem *item);
+
+ private:
+  sqlite3 *db_;
+  sqlite3_stmt *find_;
+
+  DISALLOW_COPY_AND_ASSIGN(ContentIndex);
+};
+
+#endif
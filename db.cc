@@ -14,11 +14,13 @@
  *   limitations under the License.
  */
 
+#include <stdio.h>
 #include <sqlite3.h>
 #include <glog/logging.h>
 #include "playlist.pb.h"
 #include "protostore.h"
 #include <gflags/gflags.h>
+#include "db.h"
 
 DEFINE_string(dbname, "/var/automation/music.db", "Name of database to use");
 DEFINE_bool(dbinit, false, "If true, start, create a database, and exit.");
@@ -29,13 +31,18 @@ void TraceCallback( void* udp, const char* sql ) {
   VLOG(30) << "{SQL} " << sql;
 }
 
-sqlite3* DatabaseOpen() {
+static sqlite3* OpenConnection(int flags) {
   CHECK(sqlite3_threadsafe()); 
   sqlite3 *db;
-  sqlite3_open_v2(FLAGS_dbname.c_str(), &db, SQLITE_OPEN_READWRITE | (FLAGS_dbinit ? SQLITE_OPEN_CREATE : 0), NULL);
+  sqlite3_open_v2(FLAGS_dbname.c_str(), &db, flags, NULL);
   sqlite3_trace(db, TraceCallback, NULL);
   CHECK(sqlite3_exec(db, "PRAGMA foreign_keys = ON;", NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
   CHECK(sqlite3_exec(db, "PRAGMA read_uncommitted = ON;", NULL, NULL, NULL) == SQLITE_OK);
+  return db;
+}
+
+sqlite3* DatabaseOpen() {
+  sqlite3 *db = OpenConnection(SQLITE_OPEN_READWRITE | (FLAGS_dbinit ? SQLITE_OPEN_CREATE : 0));
   if (FLAGS_dbinit) {
     InitializeSchema(db);
     LOG(INFO) << "DB created.";
@@ -45,6 +52,85 @@ sqlite3* DatabaseOpen() {
   return db;
 }
 
+ConnectionPool *ConnectionPool::instance_;
+
+ConnectionPool::ConnectionPool(size_t readers) :
+  readers_(readers),
+  writer_(DatabaseOpen()) {
+  CHECK(instance_ == NULL) << "Only one ConnectionPool may exist at a time.";
+  CHECK(sqlite3_exec(writer_, "PRAGMA journal_mode = WAL;", NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(writer_);
+  // Other connections (the main loop's, the WriteBehind thread's, the
+  // LibraryWatcher's) write too; wait for them rather than failing.
+  sqlite3_busy_timeout(writer_, 5000);
+  for (size_t i = 0; i < readers_; ++i) {
+    idle_readers_.push_back(OpenConnection(SQLITE_OPEN_READONLY));
+  }
+  instance_ = this;
+}
+
+ConnectionPool::~ConnectionPool() {
+  instance_ = NULL;
+  for (std::vector<sqlite3 *>::iterator it = idle_readers_.begin(); it != idle_readers_.end(); ++it) {
+    sqlite3_close_v2(*it);
+  }
+  sqlite3_close_v2(writer_);
+}
+
+sqlite3 *ConnectionPool::AcquireReader() {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (idle_readers_.empty()) {
+    VLOG(5) << "All " << readers_ << " pooled readers in use; opening another";
+    lock.unlock();
+    return OpenConnection(SQLITE_OPEN_READONLY);
+  }
+  sqlite3 *db = idle_readers_.back();
+  idle_readers_.pop_back();
+  return db;
+}
+
+void ConnectionPool::ReleaseReader(sqlite3 *db) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (idle_readers_.size() >= readers_) {
+    lock.unlock();
+    sqlite3_close_v2(db);
+    return;
+  }
+  idle_readers_.push_back(db);
+}
+
+sqlite3 *ConnectionPool::AcquireWriter() {
+  writer_mutex_.lock();
+  return writer_;
+}
+
+void ConnectionPool::ReleaseWriter() {
+  writer_mutex_.unlock();
+}
+
+DatabaseHandle::DatabaseHandle(Mode mode) :
+  mode_(mode),
+  pool_(ConnectionPool::get()) {
+  if (!pool_) {
+    db_ = DatabaseOpen();
+  } else if (mode_ == READ) {
+    db_ = pool_->AcquireReader();
+  } else {
+    db_ = pool_->AcquireWriter();
+  }
+}
+
+DatabaseHandle::~DatabaseHandle() {
+  if (!pool_) {
+    // close_v2 defers the close until any statements still cached by stores
+    // on this connection have been finalized.
+    sqlite3_close_v2(db_);
+  } else if (mode_ == READ) {
+    pool_->ReleaseReader(db_);
+  } else {
+    pool_->ReleaseWriter();
+  }
+}
+
 void InitializeSchema(sqlite3 *db) {
   std::string schema = 
 "CREATE TABLE Playlist(PlaylistID INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,name STRING,weight INTEGER);"
@@ -86,5 +172,88 @@ void InitializeSchema(sqlite3 *db) {
 "  ORDER BY weight DESC limit 1;";
 
   CHECK(sqlite3_exec(db, schema.c_str(), NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+  MigrateSchema(db);
 }
 
+// Changes to the schema since InitializeSchema, oldest first.  Applying
+// kMigrations[i] takes a database from version i to version i+1; the
+// schema InitializeSchema creates (and every database that predates
+// SchemaVersion) is version 0.  Only ever append to this list.
+static const char *kMigrations[] = {
+  // The ALL TRACKS superlist and the member queries sort by duration, and
+  // superlist pages seek on (duration, PlayableItemID).
+  "CREATE INDEX IF NOT EXISTS durationdex ON PlayableItem(duration, PlayableItemID);",
+  // Shuffled playlists sort their members by playcount.
+  "CREATE INDEX IF NOT EXISTS playcountdex ON PlayableItem(playcount, PlayableItemID);",
+  // joindex only helps going from a playlist to its items; this goes the
+  // other way, for finding the playlists an item is on (and for the foreign
+  // key check when an item is deleted).
+  "CREATE INDEX IF NOT EXISTS itemdex ON Playlist_PlayableItemID(PlayableItemID, PlaylistID);",
+  // Full-text index over item filenames and descriptions, for
+  // /playlist/fetch?search=.  It keeps its own copy of the text rather than
+  // reading PlayableItem's, because REPLACE INTO PlayableItem drops the old
+  // row without firing the delete trigger; the entries that leaves behind
+  // are skipped by joining against PlayableItem when searching.
+  "CREATE VIRTUAL TABLE IF NOT EXISTS PlayableItemSearch USING fts5(filename, description);"
+  "CREATE TRIGGER IF NOT EXISTS PlayableItemSearch_insert AFTER INSERT ON PlayableItem BEGIN"
+  "  DELETE FROM PlayableItemSearch WHERE rowid = new.PlayableItemID;"
+  "  INSERT INTO PlayableItemSearch (rowid, filename, description)"
+  "    VALUES (new.PlayableItemID, new.filename, new.description);"
+  " END;"
+  "CREATE TRIGGER IF NOT EXISTS PlayableItemSearch_update AFTER UPDATE OF filename, description ON PlayableItem BEGIN"
+  "  DELETE FROM PlayableItemSearch WHERE rowid = old.PlayableItemID;"
+  "  INSERT INTO PlayableItemSearch (rowid, filename, description)"
+  "    VALUES (new.PlayableItemID, new.filename, new.description);"
+  " END;"
+  "CREATE TRIGGER IF NOT EXISTS PlayableItemSearch_delete AFTER DELETE ON PlayableItem BEGIN"
+  "  DELETE FROM PlayableItemSearch WHERE rowid = old.PlayableItemID;"
+  " END;"
+  "DELETE FROM PlayableItemSearch;"
+  "INSERT INTO PlayableItemSearch (rowid, filename, description)"
+  "  SELECT PlayableItemID, filename, description FROM PlayableItem;",
+  // What acmd --command=scan last saw of each file, so that it only probes
+  // files that are new or have changed.  Files that turned out not to be
+  // playable are kept too, with no PlayableItemID, so they aren't retried.
+  "CREATE TABLE IF NOT EXISTS FileFingerprint(filename STRING NOT NULL PRIMARY KEY,"
+  "                                           inode INTEGER, size INTEGER, mtime INTEGER,"
+  "                                           PlayableItemID INTEGER);",
+  // ContentHash() of each item's file, so that a copy of a file already in
+  // the library (or one that has moved) shares its item instead of being
+  // probed and added again.  Items stored before this are hashed the next
+  // time acmd --command=scan sees them.
+  "ALTER TABLE PlayableItem ADD COLUMN contenthash INTEGER;"
+  "CREATE INDEX IF NOT EXISTS contentdex ON PlayableItem(contenthash);",
+  // Items whose files LibraryWatcher or acmd --command=scan saw go, so that
+  // they stay off the air (across restarts too) until the file is back.
+  "CREATE TABLE IF NOT EXISTS MissingItem(PlayableItemID INTEGER NOT NULL PRIMARY KEY);",
+};
+
+// Another process (acmd, started alongside the daemon, say) may be
+// migrating at the same time, so each step takes the write lock before it
+// reads the version it starts from.
+void MigrateSchema(sqlite3 *db) {
+  sqlite3_busy_timeout(db, 5000);
+  CHECK(sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS SchemaVersion(version INTEGER NOT NULL);",
+                     NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+  sqlite3_stmt *ps;
+  CHECK(sqlite3_prepare_v2(db, "SELECT max(version) FROM SchemaVersion", -1, &ps, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+  const int latest = sizeof(kMigrations) / sizeof(kMigrations[0]);
+  while (true) {
+    CHECK(sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+    CHECK(sqlite3_step(ps) == SQLITE_ROW) << sqlite3_errmsg(db);
+    int version = sqlite3_column_int(ps, 0);
+    sqlite3_reset(ps);
+    CHECK(version <= latest) << "Database schema version " << version << " is newer than this binary (" << latest << ")";
+    if (version == latest) {
+      CHECK(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+      break;
+    }
+    LOG(INFO) << "Migrating database schema to version " << version + 1;
+    char bump[128];
+    snprintf(bump, sizeof bump, "DELETE FROM SchemaVersion; INSERT INTO SchemaVersion (version) VALUES (%d);", version + 1);
+    CHECK(sqlite3_exec(db, kMigrations[version], NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+    CHECK(sqlite3_exec(db, bump, NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+    CHECK(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db);
+  }
+  sqlite3_finalize(ps);
+}
@@ -17,17 +17,73 @@
 #define DB_HEADER_H
 
 #include <sqlite3.h>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include "base.h"
 
+// Connections kept open for the short-lived users of the database (web
+// requests and schedule actions), so that they don't pay for opening a
+// handle and re-running the PRAGMAs each time.  Up to readers read-only
+// connections are kept idle; a reader checked out while they are all busy
+// gets a fresh one rather than waiting.  WRITE handles share a single
+// connection and take turns on it.  The database is switched to WAL mode, so
+// that readers never wait on a writer.
+//
+// The pool's writer is not the only one: the main loop, the WriteBehind
+// thread and the LibraryWatcher each keep a read-write connection of their
+// own for as long as they run.  SQLite still admits one writer at a time, so
+// every one of these connections sets a busy timeout and waits its turn.
+//
+// Like AutomationState there is at most one, which registers itself on
+// construction.  Read-only connections cannot bump playcounts or lock
+// playlists themselves, so whoever creates the pool must create a
+// WriteBehind as well.
+class ConnectionPool {
+ public:
+  explicit ConnectionPool(size_t readers);
+  ~ConnectionPool();
+  static ConnectionPool *get() { return instance_; }
+
+  sqlite3 *AcquireReader();
+  void ReleaseReader(sqlite3 *db);
+  // The writer may be re-acquired by the thread holding it.
+  sqlite3 *AcquireWriter();
+  void ReleaseWriter();
+
+ private:
+  static ConnectionPool *instance_;
+
+  const size_t readers_;
+  boost::mutex mutex_; // Guards idle_readers_
+  std::vector<sqlite3 *> idle_readers_;
+  boost::recursive_mutex writer_mutex_;
+  sqlite3 *writer_;
+
+  DISALLOW_COPY_AND_ASSIGN(ConnectionPool);
+};
+
+// A connection for the lifetime of the handle: checked out of the
+// ConnectionPool if there is one, otherwise opened with DatabaseOpen() and
+// closed again.  A READ handle may be read-only; anything that writes must
+// use WRITE.
 class DatabaseHandle {
  public:
-  DatabaseHandle(sqlite3 *db) : db_(db) {}
-  ~DatabaseHandle() { sqlite3_close(db_); }
+  enum Mode { READ, WRITE };
+  explicit DatabaseHandle(Mode mode);
+  ~DatabaseHandle();
   operator sqlite3*() { return db_; }
  private:
+  Mode mode_;
+  ConnectionPool *pool_;
   sqlite3 *db_;
+  DISALLOW_COPY_AND_ASSIGN(DatabaseHandle);
 };
 
 void TraceCallback( void* udp, const char* sql );
 sqlite3 *DatabaseOpen();
+// Brings an existing database's schema up to date, applying any migrations
+// it hasn't seen yet.  Safe to call on every startup.
+void MigrateSchema(sqlite3 *db);
 
 #endif
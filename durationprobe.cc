@@ -0,0 +1,295 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+// The whole file is mapped, but only the headers are looked at, so for
+// everything but an MP3 without a Xing or VBRI header the cost is a few
+// pages however long the file plays.  Walking an MP3's frames touches every
+// page once, which is still bound by the disk rather than the CPU.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <glog/logging.h>
+#include "durationprobe.h"
+
+namespace {
+
+// A bounds-checked view of the mapped file.
+class Bytes {
+ public:
+  Bytes(const unsigned char *data, size_t size) : data_(data), size_(size) {}
+  size_t size() const { return size_; }
+  bool has(size_t offset, size_t length) const {
+    return offset <= size_ && length <= size_ - offset;
+  }
+  bool Matches(size_t offset, const char *text) const {
+    size_t length = strlen(text);
+    return has(offset, length) && !memcmp(data_ + offset, text, length);
+  }
+  const unsigned char *at(size_t offset) const { return data_ + offset; }
+  uint32_t Be32(size_t offset) const {
+    const unsigned char *p = data_ + offset;
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+  }
+  uint16_t Le16(size_t offset) const {
+    const unsigned char *p = data_ + offset;
+    return p[0] | (uint16_t(p[1]) << 8);
+  }
+  uint32_t Le32(size_t offset) const {
+    return Le16(offset) | (uint32_t(Le16(offset + 2)) << 16);
+  }
+  uint64_t Le64(size_t offset) const {
+    return Le32(offset) | (uint64_t(Le32(offset + 4)) << 32);
+  }
+
+ private:
+  const unsigned char *data_;
+  size_t size_;
+};
+
+bool ProbeWav(const Bytes& file, double *seconds) {
+  if (!file.Matches(0, "RIFF") || !file.Matches(8, "WAVE")) {
+    return false;
+  }
+  uint32_t byte_rate = 0;
+  for (size_t chunk = 12; file.has(chunk, 8); ) {
+    uint32_t length = file.Le32(chunk + 4);
+    if (file.Matches(chunk, "fmt ") && file.has(chunk + 8, 16)) {
+      byte_rate = file.Le32(chunk + 16);
+    } else if (file.Matches(chunk, "data")) {
+      if (!byte_rate) {
+        return false;
+      }
+      // Streamed WAVs leave the length unset (0 or ~0); take the rest of
+      // the file then.
+      uint64_t available = file.size() - chunk - 8;
+      *seconds = double(length && length <= available ? length : available) / byte_rate;
+      return true;
+    }
+    chunk += 8 + length + (length & 1);
+  }
+  return false;
+}
+
+bool ProbeFlac(const Bytes& file, double *seconds) {
+  // STREAMINFO is always the first metadata block.
+  if (!file.Matches(0, "fLaC") || !file.has(8, 18) || (*file.at(4) & 0x7f) != 0) {
+    return false;
+  }
+  const unsigned char *info = file.at(8);
+  uint32_t sample_rate = (uint32_t(info[10]) << 12) | (uint32_t(info[11]) << 4) | (info[12] >> 4);
+  uint64_t samples = (uint64_t(info[13] & 0x0f) << 32) | (uint64_t(info[14]) << 24) |
+                     (uint32_t(info[15]) << 16) | (uint32_t(info[16]) << 8) | info[17];
+  if (!sample_rate || !samples) {
+    return false;  // Unknown; the encoder couldn't seek back to fill it in.
+  }
+  *seconds = double(samples) / sample_rate;
+  return true;
+}
+
+bool ProbeOgg(const Bytes& file, double *seconds) {
+  static const size_t kPageHeader = 27;
+  if (!file.Matches(0, "OggS") || !file.has(0, kPageHeader)) {
+    return false;
+  }
+  uint32_t serial = file.Le32(14);
+  size_t packet = kPageHeader + *file.at(26);
+  uint32_t sample_rate;
+  uint64_t skip = 0;
+  if (file.Matches(packet, "\x01vorbis") && file.has(packet, 16)) {
+    sample_rate = file.Le32(packet + 12);
+  } else if (file.Matches(packet, "OpusHead") && file.has(packet, 12)) {
+    sample_rate = 48000;  // Opus granules count 48kHz samples, whatever the input rate.
+    skip = file.Le16(packet + 10);
+  } else {
+    return false;
+  }
+  if (!sample_rate) {
+    return false;
+  }
+  // The last page of our stream that finishes a packet has the total.
+  for (size_t page = file.size() - kPageHeader + 1; page-- > 0; ) {
+    if (*file.at(page) != 'O' || !file.Matches(page, "OggS") || file.Le32(page + 14) != serial) {
+      continue;
+    }
+    uint64_t granule = file.Le64(page + 6);
+    if (granule == ~uint64_t(0)) {
+      continue;
+    }
+    *seconds = double(granule > skip ? granule - skip : 0) / sample_rate;
+    return true;
+  }
+  return false;
+}
+
+// An MPEG audio frame header.
+struct MpegFrame {
+  bool mpeg1;
+  int layer;
+  bool mono;
+  int sample_rate;
+  int samples;  // Per frame.
+  size_t length;
+};
+
+bool ParseMpegFrame(const Bytes& file, size_t offset, MpegFrame *frame) {
+  static const int kBitrates[2][3][15] = {
+    {  // MPEG-2 and 2.5, layers I, II and III.
+      { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+      { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+      { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+    }, {  // MPEG-1.
+      { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+      { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+      { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+    },
+  };
+  static const int kSampleRates[3] = { 44100, 48000, 32000 };
+  if (!file.has(offset, 4)) {
+    return false;
+  }
+  const unsigned char *h = file.at(offset);
+  int version = (h[1] >> 3) & 3;  // 0 is MPEG-2.5, 2 MPEG-2, 3 MPEG-1.
+  int layer = 4 - ((h[1] >> 1) & 3);
+  int bitrate_index = h[2] >> 4;
+  int rate_index = (h[2] >> 2) & 3;
+  if (h[0] != 0xff || (h[1] & 0xe0) != 0xe0 || version == 1 || layer == 4 ||
+      bitrate_index == 0 || bitrate_index == 15 || rate_index == 3) {
+    return false;  // Not a header, or free format, which we can't walk.
+  }
+  frame->mpeg1 = version == 3;
+  frame->layer = layer;
+  frame->mono = (h[3] >> 6) == 3;
+  frame->sample_rate = kSampleRates[rate_index] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+  int bitrate = kBitrates[frame->mpeg1][layer - 1][bitrate_index] * 1000;
+  int padding = (h[2] >> 1) & 1;
+  if (layer == 1) {
+    frame->samples = 384;
+    frame->length = (12 * bitrate / frame->sample_rate + padding) * 4;
+  } else {
+    frame->samples = (layer == 3 && !frame->mpeg1) ? 576 : 1152;
+    frame->length = frame->samples / 8 * bitrate / frame->sample_rate + padding;
+  }
+  return true;
+}
+
+// The first frame whose successor is where it says, skipping anything that
+// only looks like a frame.
+bool FindFirstMpegFrame(const Bytes& file, size_t *offset, MpegFrame *frame) {
+  static const size_t kSearchLimit = 64 << 10;
+  MpegFrame next;
+  for (size_t end = *offset + kSearchLimit; *offset < end && file.has(*offset, 4); ++*offset) {
+    if (ParseMpegFrame(file, *offset, frame) &&
+        (*offset + frame->length == file.size() ||
+         ParseMpegFrame(file, *offset + frame->length, &next))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ProbeMp3(const Bytes& file, double *seconds) {
+  size_t offset = 0;
+  if (file.Matches(0, "ID3") && file.has(0, 10)) {
+    const unsigned char *h = file.at(0);
+    offset = 10 + ((h[6] & 0x7f) << 21 | (h[7] & 0x7f) << 14 | (h[8] & 0x7f) << 7 | (h[9] & 0x7f));
+    if (h[5] & 0x10) {
+      offset += 10;  // Footer.
+    }
+  }
+  MpegFrame frame;
+  if (!FindFirstMpegFrame(file, &offset, &frame)) {
+    return false;
+  }
+
+  // A VBR encoder leaves the frame count in a Xing (or Info, or VBRI) header
+  // in place of the first frame's audio.
+  size_t side_info = frame.mpeg1 ? (frame.mono ? 17 : 32) : (frame.mono ? 9 : 17);
+  size_t xing = offset + 4 + side_info;
+  uint32_t frames = 0;
+  if ((file.Matches(xing, "Xing") || file.Matches(xing, "Info")) && file.has(xing, 12) &&
+      (file.Be32(xing + 4) & 1)) {
+    frames = file.Be32(xing + 8);
+  } else if (file.Matches(offset + 36, "VBRI") && file.has(offset + 36, 18)) {
+    frames = file.Be32(offset + 36 + 14);
+  }
+  if (frames) {
+    *seconds = double(frames) * frame.samples / frame.sample_rate;
+    return true;
+  }
+
+  // Otherwise count them.  Frames may differ in length and sample rate
+  // (VBR without a header, or a badly cut file), so add each one up.
+  size_t start = offset;
+  size_t covered = 0;
+  double total = 0;
+  while (file.has(offset, 4)) {
+    if (ParseMpegFrame(file, offset, &frame) && frame.length > 4) {
+      total += double(frame.samples) / frame.sample_rate;
+      covered += frame.length;
+      offset += frame.length;
+    } else if (!FindFirstMpegFrame(file, &offset, &frame)) {
+      break;  // Trailing tags, or junk.
+    }
+  }
+  // Some other format can look like the odd frame here and there; a real
+  // MP3 is frames from end to end, give or take its tags.
+  if (total <= 0 || covered < (file.size() - start) / 10 * 9) {
+    return false;
+  }
+  *seconds = total;
+  return true;
+}
+
+}  // namespace
+
+bool ProbeDuration(const std::string& filename, double *seconds) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) || info.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  size_t size = info.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  Bytes file(static_cast<const unsigned char *>(data), size);
+  bool found;
+  if (file.Matches(0, "RIFF")) {
+    found = ProbeWav(file, seconds);
+  } else if (file.Matches(0, "fLaC")) {
+    found = ProbeFlac(file, seconds);
+  } else if (file.Matches(0, "OggS")) {
+    found = ProbeOgg(file, seconds);  // Not Ogg FLAC, though.
+  } else {
+    found = ProbeMp3(file, seconds);
+  }
+  munmap(data, size);
+  if (found) {
+    VLOG(5) << "Probed " << filename << " at " << *seconds << " seconds";
+  }
+  return found;
+}
@@ -0,0 +1,29 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef DURATIONPROBE_H
+#define DURATIONPROBE_H
+
+#include <string>
+
+// Works out how long the audio file at filename plays for, in seconds, from
+// its headers rather than by decoding it: MP3 (from a Xing/Info or VBRI
+// header, or else by walking the frame headers), FLAC (STREAMINFO), Ogg
+// Vorbis and Opus (the last page's granule position) and WAV (the data
+// chunk's size).  Returns false for anything else, or anything it can't make
+// sense of, in which case the caller should ask mplayer instead.
+bool ProbeDuration(const std::string& filename, double *seconds);
+
+#endif
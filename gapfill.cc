@@ -0,0 +1,163 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+// FillGap works breadth first on the number of entries: reach[k] is a bitset
+// of the totals that k entries can add up to, found by shifting reach[k - 1]
+// left by each distinct duration.  The first k whose bitset has a bit inside
+// the window gives the fewest entries; the set itself is then recovered by
+// walking back down the levels.  The bitsets ignore how many entries share
+// each duration, so the walk back checks that and backtracks when it runs
+// out of them.
+//
+// Everything is bounded by longest, so the cost depends on the size of the
+// window and the number of distinct durations, not on the size of the list.
+
+#include <algorithm>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/dynamic_bitset.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include "gapfill.h"
+
+DEFINE_int32(gapfill_budget_ms, 5, "Wall-clock milliseconds allowed to choose the bumpers that fill "
+  "the time before a requirement.  When they run out we fall back to playing whichever bumper fits.");
+DEFINE_int32(gapfill_max_seconds, 3600, "Longest stretch of time the bumper gap filler will try to fill.");
+
+typedef boost::dynamic_bitset<> Totals;
+// Indexed by duration; most durations have no entries.
+typedef std::vector<std::vector<int> > PositionsByDuration;
+
+namespace {
+
+class GapFiller {
+ public:
+  GapFiller(const PositionsByDuration& positions, const std::vector<sqlite3_int64>& distinct,
+            const std::vector<Totals>& reach, boost::posix_time::ptime deadline) :
+    positions_(positions), distinct_(distinct), reach_(reach), deadline_(deadline),
+    used_(positions.size()) {
+  }
+
+  // Finds level entries adding up to total, consistent with reach_.  The
+  // longest durations are tried first.
+  bool Walk(size_t level, sqlite3_int64 total) {
+    if (level == 0) {
+      return total == 0;
+    }
+    if (boost::posix_time::microsec_clock::universal_time() > deadline_) {
+      return false;
+    }
+    for (std::vector<sqlite3_int64>::const_reverse_iterator it = distinct_.rbegin(); it != distinct_.rend(); ++it) {
+      sqlite3_int64 duration = *it;
+      size_t& used = used_[duration];
+      if (duration > total || used == positions_[duration].size() || !reach_[level - 1][total - duration]) {
+        continue;
+      }
+      used++;
+      if (Walk(level - 1, total - duration)) {
+        return true;
+      }
+      used--;
+    }
+    return false;
+  }
+
+  void Chosen(std::vector<int> *chosen) const {
+    chosen->clear();
+    for (std::vector<sqlite3_int64>::const_iterator it = distinct_.begin(); it != distinct_.end(); ++it) {
+      const std::vector<int>& same = positions_[*it];
+      chosen->insert(chosen->end(), same.begin(), same.begin() + used_[*it]);
+    }
+    std::sort(chosen->begin(), chosen->end());
+  }
+
+ private:
+  const PositionsByDuration& positions_;
+  const std::vector<sqlite3_int64>& distinct_;
+  const std::vector<Totals>& reach_;
+  const boost::posix_time::ptime deadline_;
+  std::vector<size_t> used_;
+};
+
+}  // namespace
+
+bool FillGap(const std::vector<sqlite3_int64>& durations, sqlite3_int64 shortest,
+             sqlite3_int64 target, sqlite3_int64 longest, std::vector<int> *chosen) {
+  boost::posix_time::ptime deadline = boost::posix_time::microsec_clock::universal_time() +
+      boost::posix_time::milliseconds(FLAGS_gapfill_budget_ms);
+  shortest = std::max<sqlite3_int64>(shortest, 1);
+  longest = std::min<sqlite3_int64>(longest, FLAGS_gapfill_max_seconds);
+  if (shortest > longest) {
+    return false;
+  }
+
+  // No total in the window can use more than longest / duration entries of
+  // any one duration, so there's no point in remembering more.
+  PositionsByDuration positions(longest + 1);
+  std::vector<sqlite3_int64> distinct;
+  for (size_t i = 0; i < durations.size(); ++i) {
+    sqlite3_int64 duration = durations[i];
+    if (duration > 0 && duration <= longest) {
+      std::vector<int>& same = positions[duration];
+      if (same.empty()) {
+        distinct.push_back(duration);
+      }
+      if (same.size() < static_cast<size_t>(longest / duration)) {
+        same.push_back(i);
+      }
+    }
+  }
+  if (distinct.empty()) {
+    return false;
+  }
+  std::sort(distinct.begin(), distinct.end());
+
+  std::vector<Totals> reach(1, Totals(longest + 1));
+  reach[0].set(0);
+  // Every entry lasts at least a second, so nothing longer can fit.
+  for (sqlite3_int64 level = 1; level <= longest; ++level) {
+    Totals next(longest + 1);
+    for (std::vector<sqlite3_int64>::const_iterator it = distinct.begin(); it != distinct.end(); ++it) {
+      next |= reach.back() << *it;
+    }
+    if (next.none()) {
+      break;
+    }
+    reach.push_back(next);
+
+    // Candidate totals in the window, nearest the target first.
+    std::vector<std::pair<sqlite3_int64, sqlite3_int64> > candidates;
+    for (sqlite3_int64 total = shortest; total <= longest; ++total) {
+      if (next[total]) {
+        candidates.push_back(std::make_pair(total > target ? total - target : target - total, total));
+      }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for (size_t i = 0; i < candidates.size(); ++i) {
+      GapFiller filler(positions, distinct, reach, deadline);
+      if (filler.Walk(level, candidates[i].second)) {
+        filler.Chosen(chosen);
+        VLOG(5) << "Filling " << target << " seconds with " << level << " items lasting "
+                << candidates[i].second;
+        return true;
+      }
+    }
+    if (boost::posix_time::microsec_clock::universal_time() > deadline) {
+      LOG(WARNING) << "Ran out of time choosing bumpers for " << target << " seconds";
+      return false;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,32 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef GAPFILL_H
+#define GAPFILL_H
+
+#include <vector>
+#include "sqlite3.h"
+
+// Chooses entries of durations (in seconds) that together last between
+// shortest and longest seconds, using as few entries as possible and, among
+// those, landing as close to target as possible.  Where several entries
+// share a duration the earliest are used, so list order is respected.
+//
+// The positions chosen are stored in *chosen in ascending order.  Returns
+// false if there is no such set, or none was found within --gapfill_budget_ms.
+bool FillGap(const std::vector<sqlite3_int64>& durations, sqlite3_int64 shortest,
+             sqlite3_int64 target, sqlite3_int64 longest, std::vector<int> *chosen);
+
+#endif
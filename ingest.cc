@@ -0,0 +1,397 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <unistd.h>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <glog/logging.h>
+#include "contenthash.h"
+#include "db.h"
+#include "ingest.h"
+#include "playableitem.h"
+#include "protostore.h"
+
+// How many probed files may wait for a prober, per prober.
+static const size_t kQueuedPerProber = 16;
+// sqlite's default limit on the parameters of a statement is 999.
+static const size_t kMaxLookupBatch = 500;
+
+static std::string LookupSql(size_t count) {
+  std::string sql = "SELECT PlayableItemID, filename, duration FROM PlayableItem WHERE filename IN (?";
+  for (size_t i = 1; i < count; ++i) {
+    sql += ",?";
+  }
+  return sql + ")";
+}
+
+static size_t LookupBatchSize(size_t batch_size) {
+  return std::max<size_t>(1, std::min(batch_size, kMaxLookupBatch));
+}
+
+Ingest::Ingest(sqlite3 *db, size_t batch_size, int probers, bool in_order, FILE *out) :
+  db_(CHECK_NOTNULL(db)),
+  batch_size_(std::max<size_t>(batch_size, 1)),
+  in_order_(in_order),
+  out_(out),
+  lookup_(NULL),
+  queue_capacity_(kQueuedPerProber * std::max(probers, 1)),
+  lines_(0),
+  probers_running_(std::max(probers, 1)),
+  finishing_(false),
+  writer_done_(false),
+  next_line_(0) {
+  // The probers' connections read while the writer commits; without WAL,
+  // that means waiting for each other now and then.
+  sqlite3_busy_timeout(db_, 5000);
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_, LookupSql(LookupBatchSize(batch_size_)).c_str(), -1,
+                                        &lookup_, NULL)) << sqlite3_errmsg(db_);
+  for (int i = 0; i < probers_running_; ++i) {
+    threads_.create_thread(boost::bind(&Ingest::Probe, this));
+  }
+  threads_.create_thread(boost::bind(&Ingest::Write, this));
+}
+
+Ingest::~Ingest() {
+  Finish();
+  sqlite3_finalize(lookup_);
+}
+
+void Ingest::Add(const std::string& filename) {
+  unlooked_.push_back(std::make_pair(lines_++, filename));
+  if (unlooked_.size() >= LookupBatchSize(batch_size_)) {
+    LookupBatch();
+  }
+}
+
+void Ingest::Finish() {
+  if (!unlooked_.empty()) {
+    LookupBatch();
+  }
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    finishing_ = true;
+    probe_ready_.notify_all();
+    while (!writer_done_) {
+      done_.wait(lock);
+    }
+  }
+  threads_.join_all();
+}
+
+// Prints the lines found in the library and queues the rest for probing.
+// A file already queued just gains another line.
+void Ingest::LookupBatch() {
+  std::map<std::string, std::vector<size_t> > wanted;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    for (size_t i = 0; i < unlooked_.size(); ++i) {
+      JobMap::iterator job = jobs_.find(unlooked_[i].second);
+      if (job != jobs_.end()) {
+        job->second->lines.push_back(unlooked_[i].first);
+      } else {
+        wanted[unlooked_[i].second].push_back(unlooked_[i].first);
+      }
+    }
+  }
+  unlooked_.clear();
+  if (wanted.empty()) {
+    return;
+  }
+
+  sqlite3_stmt *ps = lookup_;
+  if (wanted.size() != LookupBatchSize(batch_size_)) {
+    CHECK(SQLITE_OK == sqlite3_prepare_v2(db_, LookupSql(wanted.size()).c_str(), -1, &ps, NULL))
+        << sqlite3_errmsg(db_);
+  }
+  int param = 1;
+  for (std::map<std::string, std::vector<size_t> >::iterator it = wanted.begin(); it != wanted.end(); ++it) {
+    sqlite3_bind_text(ps, param++, it->first.data(), it->first.size(), SQLITE_STATIC);
+  }
+  std::vector<std::pair<std::string, sqlite3_int64> > found;
+  int rc;
+  while ((rc = sqlite3_step(ps)) == SQLITE_ROW) {
+    const char *filename = reinterpret_cast<const char *>(sqlite3_column_text(ps, 1));
+    sqlite3_int64 id = sqlite3_column_int64(ps, 0);
+    found.push_back(std::make_pair(std::string(filename ? filename : ""),
+                                   sqlite3_column_int64(ps, 2) > 0 ? id : -1));
+  }
+  CHECK(rc == SQLITE_DONE) << "Unable to look up files: " << sqlite3_errmsg(db_);
+  sqlite3_reset(ps);
+  sqlite3_clear_bindings(ps);
+  if (ps != lookup_) {
+    sqlite3_finalize(ps);
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+  for (size_t i = 0; i < found.size(); ++i) {
+    std::map<std::string, std::vector<size_t> >::iterator it = wanted.find(found[i].first);
+    if (it == wanted.end()) {
+      continue;
+    }
+    for (size_t j = 0; j < it->second.size(); ++j) {
+      ResolveLocked(it->second[j], found[i].second, it->first);
+    }
+    wanted.erase(it);
+  }
+  for (std::map<std::string, std::vector<size_t> >::iterator it = wanted.begin(); it != wanted.end(); ++it) {
+    Job *job = new Job(it->first);
+    job->lines.swap(it->second);
+    QueueLocked(job, &lock);
+  }
+}
+
+void Ingest::Refresh(const std::string& filename, sqlite3_int64 id) {
+  boost::mutex::scoped_lock lock(mutex_);
+  JobMap::iterator queued = jobs_.find(filename);
+  if (queued != jobs_.end()) {
+    queued->second->lines.push_back(lines_++);
+    return;
+  }
+  Job *job = new Job(filename);
+  job->lines.push_back(lines_++);
+  job->refresh = true;
+  job->item.set_playableitemid(id);
+  QueueLocked(job, &lock);
+}
+
+void Ingest::Hash(const std::string& filename, sqlite3_int64 id, sqlite3_int64 duration) {
+  boost::mutex::scoped_lock lock(mutex_);
+  JobMap::iterator queued = jobs_.find(filename);
+  if (queued != jobs_.end()) {
+    queued->second->lines.push_back(lines_++);
+    return;
+  }
+  Job *job = new Job(filename);
+  job->lines.push_back(lines_++);
+  job->refresh = true;
+  job->item.set_playableitemid(id);
+  job->item.set_duration(duration);
+  QueueLocked(job, &lock);
+}
+
+void Ingest::set_listener(const Listener& listener) {
+  boost::mutex::scoped_lock lock(mutex_);
+  listener_ = listener;
+}
+
+// Waits for room, if need be, and hands job to the probers.
+void Ingest::QueueLocked(Job *job, boost::mutex::scoped_lock *lock) {
+  jobs_[job->filename] = job;
+  while (probe_queue_.size() >= queue_capacity_) {
+    room_.wait(*lock);
+  }
+  probe_queue_.push_back(job);
+  probe_ready_.notify_one();
+}
+
+void Ingest::Probe() {
+  DatabaseHandle reader(DatabaseHandle::READ);
+  sqlite3_busy_timeout(reader, 5000);
+  ContentIndex index(reader);
+  boost::mutex::scoped_lock lock(mutex_);
+  while (true) {
+    while (!finishing_ && probe_queue_.empty()) {
+      probe_ready_.wait(lock);
+    }
+    if (probe_queue_.empty()) {
+      break;
+    }
+    Job *job = probe_queue_.front();
+    probe_queue_.pop_front();
+    room_.notify_one();
+    lock.unlock();
+
+    job->item.set_filename(job->filename);
+    if (!Identify(&index, job) && job->item.duration() <= 0) {
+      job->item.set_duration(PlayableItem::MeasureDuration(job->filename));
+      VLOG(30) << "Probed " << job->filename << " at " << job->item.duration();
+    }
+
+    lock.lock();
+    write_queue_.push_back(job);
+    if (write_queue_.size() >= batch_size_) {
+      write_ready_.notify_one();
+    }
+  }
+  probers_running_--;
+  write_ready_.notify_one();
+}
+
+// Hashes job's file and looks for an item with the same content.  A hash
+// match alone isn't trusted: a new file shares the item, without being
+// probed, only if it holds the same bytes as the item's file, and takes the
+// item over only if the item's file has gone and the new one, probed,
+// lasts just as long.  (Gone may only mean unmounted, and a hash collision
+// there would otherwise rename someone else's item.)  A changed file is
+// always probed, as there is nothing left of its old content to compare.
+// Returns true if the file has been probed already.
+bool Ingest::Identify(ContentIndex *index, Job *job) {
+  sqlite3_int64 hash;
+  if (!ContentHash(job->filename, &hash)) {
+    return false;
+  }
+  job->item.set_contenthash(hash);
+  automation::PlayableItem known;
+  if (job->refresh || !index->Find(hash, &known)) {
+    return false;
+  }
+  if (!access(known.filename().c_str(), F_OK)) {
+    if (SameContent(job->filename, known.filename())) {
+      job->shared = true;
+      job->item.set_playableitemid(known.playableitemid());
+      job->item.set_duration(known.duration());
+      VLOG(5) << job->filename << " is a copy of item " << known.playableitemid() << ", " << known.filename();
+    }
+    return false;
+  }
+  job->item.set_duration(PlayableItem::MeasureDuration(job->filename));
+  if (job->item.duration() != known.duration()) {
+    return true;
+  }
+  boost::mutex::scoped_lock lock(mutex_);
+  if (moved_.insert(known.playableitemid()).second) {
+    job->refresh = true;
+    job->item.set_playableitemid(known.playableitemid());
+    VLOG(5) << "Item " << known.playableitemid() << " moved from " << known.filename() << " to " << job->filename;
+  }
+  return true;
+}
+
+void Ingest::Write() {
+  ContentIndex index(db_);
+  automation::ProtoStore<automation::PlayableItem> store(db_);
+  boost::mutex::scoped_lock lock(mutex_);
+  while (true) {
+    while (probers_running_ && write_queue_.size() < batch_size_) {
+      write_ready_.wait(lock);
+    }
+    if (write_queue_.empty()) {
+      break;  // Every prober has quit, so nothing more is coming.
+    }
+    std::vector<Job*> batch;
+    batch.swap(write_queue_);
+    lock.unlock();
+    ShareCopies(&index, &batch);
+    WriteBatch(&store, &batch);
+    lock.lock();
+  }
+  writer_done_ = true;
+  done_.notify_all();
+}
+
+// Copies that nothing was stored with when they were probed: files whose
+// content was added by an earlier batch, or by another file in this one.
+// Only the first file of each is stored; the rest share its item.  As in
+// Identify, a hash match counts only once the bytes are compared.
+void Ingest::ShareCopies(ContentIndex *index, std::vector<Job*> *batch) {
+  std::map<sqlite3_int64, Job*> firsts;
+  std::vector<Job*> unique;
+  for (std::vector<Job*>::iterator it = batch->begin(); it != batch->end(); ++it) {
+    Job *job = *it;
+    automation::PlayableItem known;
+    if (job->refresh || job->shared || job->item.duration() <= 0 || !job->item.has_contenthash()) {
+      unique.push_back(job);
+      continue;
+    }
+    if (index->Find(job->item.contenthash(), &known) && SameContent(job->filename, known.filename())) {
+      job->shared = true;
+      job->item.set_playableitemid(known.playableitemid());
+      unique.push_back(job);
+      continue;
+    }
+    std::map<sqlite3_int64, Job*>::iterator first = firsts.find(job->item.contenthash());
+    if (first != firsts.end() && SameContent(job->filename, first->second->filename)) {
+      first->second->copies.push_back(job);
+      continue;
+    }
+    if (first == firsts.end()) {
+      firsts[job->item.contenthash()] = job;
+    }
+    unique.push_back(job);
+  }
+  batch->swap(unique);
+}
+
+// Stores the new jobs that found a duration, updates the refreshed ones,
+// and resolves every job's lines.
+void Ingest::WriteBatch(automation::ProtoStore<automation::PlayableItem> *store,
+                        std::vector<Job*> *batch) {
+  for (int refreshed = 0; refreshed < 2; ++refreshed) {
+    std::vector<automation::PlayableItem> items;
+    std::vector<Job*> written;
+    for (std::vector<Job*>::iterator it = batch->begin(); it != batch->end(); ++it) {
+      if ((*it)->item.duration() > 0 && (*it)->refresh == bool(refreshed) && !(*it)->shared) {
+        items.push_back((*it)->item);
+        written.push_back(*it);
+      }
+    }
+    std::vector<automation::RowError> errors;
+    if (refreshed) {
+      store->UpdateBatch(items.begin(), items.end(), &errors, batch_size_);
+    } else {
+      store->ReplaceBatch(items.begin(), items.end(), &errors, batch_size_);
+    }
+    for (std::vector<automation::RowError>::iterator it = errors.begin(); it != errors.end(); ++it) {
+      LOG(WARNING) << "Unable to store " << items[it->index].filename() << ": " << it->message;
+      items[it->index].clear_playableitemid();
+    }
+    for (size_t i = 0; i < written.size(); ++i) {
+      written[i]->item.set_playableitemid(items[i].has_playableitemid() ? items[i].playableitemid() : -1);
+    }
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+  for (std::vector<Job*>::iterator it = batch->begin(); it != batch->end(); ++it) {
+    Job *job = *it;
+    if (job->item.duration() <= 0 && job->refresh) {
+      LOG(WARNING) << job->filename << " (" << job->item.playableitemid() << ") has changed and "
+                   << "can no longer be played.";
+    }
+    sqlite3_int64 id = job->item.duration() > 0 ? job->item.playableitemid() : -1;
+    for (size_t i = 0; i < job->lines.size(); ++i) {
+      ResolveLocked(job->lines[i], id, job->filename);
+    }
+    for (std::vector<Job*>::iterator copy = job->copies.begin(); copy != job->copies.end(); ++copy) {
+      for (size_t i = 0; i < (*copy)->lines.size(); ++i) {
+        ResolveLocked((*copy)->lines[i], id, (*copy)->filename);
+      }
+      jobs_.erase((*copy)->filename);
+      delete *copy;
+    }
+    jobs_.erase(job->filename);
+    delete job;
+  }
+}
+
+void Ingest::ResolveLocked(size_t line, sqlite3_int64 id, const std::string& filename) {
+  if (listener_) {
+    listener_(filename, id);
+  }
+  if (!in_order_) {
+    if (id >= 0) {
+      fprintf(out_, "%lld\t%s\n", id, filename.c_str());
+    }
+    return;
+  }
+  held_[line] = std::make_pair(id, filename);
+  while (!held_.empty() && held_.begin()->first == next_line_) {
+    if (held_.begin()->second.first >= 0) {
+      fprintf(out_, "%lld\t%s\n", held_.begin()->second.first, held_.begin()->second.second.c_str());
+    }
+    held_.erase(held_.begin());
+    next_line_++;
+  }
+}
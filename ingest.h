@@ -0,0 +1,139 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdio.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "base.h"
+#include "playableitem.pb.h"
+#include "protostore.h"
+#include "sqlite3.h"
+
+class ContentIndex;
+
+// Ingest adds files to the library for acmd --command=load, as a pipeline:
+//
+//   Add() -> lookup -> probe queue -> probers -> write queue -> writer -> out
+//
+// The caller's thread looks its filenames up against findex a batch at a
+// time.  Files not in the library yet are queued (boundedly, so a fast
+// reader waits for the rest) for a pool of threads that work out their
+// durations, and a single writer thread stores them batch_size rows per
+// transaction.  Files can also be sent for probing as they are, to update
+// the duration of an item whose file has changed.
+//
+// A prober hashes each file (see ContentHash) before probing it.  A new
+// file that turns out to be a byte-for-byte copy of an item's file shares
+// that item, unprobed, rather than adding another; one whose hash matches
+// an item whose file has gone, and that lasts as long, takes the item over
+// (it was moved).
+//
+// Each file that is or ends up in the library is printed as
+// "ID\tfilename"; files with no duration, or that the database rejects, are
+// left out.  The lookups and the writer share the caller's connection, which
+// sqlite serializes.  Each prober reads through a connection of its own
+// (a DatabaseHandle), so that it neither waits on the writer nor sees rows
+// the writer hasn't committed, and might yet roll back.
+class Ingest {
+ public:
+  // With in_order, output follows the order of Add(); otherwise each line
+  // is printed as soon as its ID is known.
+  Ingest(sqlite3 *db, size_t batch_size, int probers, bool in_order, FILE *out);
+  ~Ingest();
+
+  void Add(const std::string& filename);
+  // Works out the duration of filename, which is item id, afresh, and
+  // updates the item with it.
+  void Refresh(const std::string& filename, sqlite3_int64 id);
+  // Records the content hash of filename, which is item id and lasts
+  // duration seconds, for an item stored before there were hashes.
+  void Hash(const std::string& filename, sqlite3_int64 id, sqlite3_int64 duration);
+  // Called with each filename as its ID becomes known (-1 for files left
+  // out), from whichever thread learns it.
+  typedef boost::function<void(const std::string& filename, sqlite3_int64 id)> Listener;
+  void set_listener(const Listener& listener);
+  // Blocks until everything added has been stored and printed.
+  void Finish();
+
+ private:
+  // A file to be probed (and stored, or with an ID, updated), and the input
+  // lines naming it.
+  struct Job {
+    explicit Job(const std::string& f) : filename(f), refresh(false), shared(false) {}
+    std::string filename;
+    bool refresh;  // Already an item, whose ID is in item.
+    bool shared;   // A copy of item, which is already stored.
+    std::vector<size_t> lines;
+    automation::PlayableItem item;
+    std::vector<Job*> copies;  // Later jobs for the same content, which share item.
+  };
+  typedef std::map<std::string, Job*> JobMap;
+
+  void LookupBatch();
+  void QueueLocked(Job *job, boost::mutex::scoped_lock *lock);
+  void Probe();
+  bool Identify(ContentIndex *index, Job *job);
+  void Write();
+  void ShareCopies(ContentIndex *index, std::vector<Job*> *batch);
+  void WriteBatch(automation::ProtoStore<automation::PlayableItem> *store, std::vector<Job*> *batch);
+  // Records the outcome for line; id < 0 leaves it out of the output.
+  void ResolveLocked(size_t line, sqlite3_int64 id, const std::string& filename);
+
+  sqlite3 *db_;
+  const size_t batch_size_;
+  const bool in_order_;
+  FILE *out_;
+  sqlite3_stmt *lookup_;  // For a full batch; shorter ones are prepared as needed.
+  const size_t queue_capacity_;
+
+  // Filenames added but not yet looked up, by line.  Only the caller's
+  // thread touches these.
+  std::vector<std::pair<size_t, std::string> > unlooked_;
+  size_t lines_;
+
+  // mutex_ guards everything below.
+  boost::mutex mutex_;
+  boost::condition_variable probe_ready_;  // Signalled when probe_queue_ grows, or on Finish.
+  boost::condition_variable write_ready_;  // Signalled when write_queue_ grows, or a prober quits.
+  boost::condition_variable room_;         // Signalled when probe_queue_ shrinks.
+  boost::condition_variable done_;         // Signalled when the writer quits.
+  JobMap jobs_;                   // Every Job queued, probing or being written.
+  std::deque<Job*> probe_queue_;
+  std::vector<Job*> write_queue_;
+  std::set<sqlite3_int64> moved_;  // Items a new file has taken over.
+  Listener listener_;
+  int probers_running_;
+  bool finishing_;
+  bool writer_done_;
+  // Lines resolved but held back until those before them are, with in_order_.
+  std::map<size_t, std::pair<sqlite3_int64, std::string> > held_;
+  size_t next_line_;              // The first line not yet printed, with in_order_.
+
+  boost::thread_group threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(Ingest);
+};
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <boost/bind.hpp>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include "catalog.h"
+#include "librarywatcher.h"
+#include "playableitem.h"
+
+DEFINE_int32(watch_debounce_ms, 2000, "Milliseconds a watched file must go unchanged before it is "
+  "added to the library.");
+
+LibraryWatcher::LibraryWatcher(sqlite3 *db, const std::vector<std::string>& roots) :
+  db_(CHECK_NOTNULL(db)),
+  roots_(roots),
+  fd_(-1),
+  fingerprint_(NULL),
+  record_(NULL),
+  find_(NULL),
+  find_under_(NULL),
+  store_(db),
+  index_(db),
+  stopping_(false) {
+#ifdef __linux__
+  fd_ = inotify_init();
+  CHECK(fd_ != -1) << "Unable to watch the library: " << strerror(errno);
+#else
+  LOG(WARNING) << "Watching the library needs inotify, which this system doesn't have.";
+  return;
+#endif
+  sqlite3_busy_timeout(db_, 5000);
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_,
+      "SELECT inode, size, mtime, PlayableItemID FROM FileFingerprint WHERE filename = ?1",
+      -1, &fingerprint_, NULL)) << sqlite3_errmsg(db_);
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_,
+      "REPLACE INTO FileFingerprint (filename, inode, size, mtime, PlayableItemID) "
+      "  VALUES (?1, ?2, ?3, ?4, ?5)",
+      -1, &record_, NULL)) << sqlite3_errmsg(db_);
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_,
+      "SELECT PlayableItemID FROM PlayableItem WHERE filename = ?1",
+      -1, &find_, NULL)) << sqlite3_errmsg(db_);
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_,
+      "SELECT PlayableItemID, filename FROM PlayableItem "
+      "  WHERE filename = ?1 OR (filename > ?1 || '/' AND filename < ?1 || '0')",
+      -1, &find_under_, NULL)) << sqlite3_errmsg(db_);
+  thread_ = boost::thread(boost::bind(&LibraryWatcher::Run, this));
+}
+
+LibraryWatcher::~LibraryWatcher() {
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stopping_ = true;
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  sqlite3_finalize(fingerprint_);
+  sqlite3_finalize(record_);
+  sqlite3_finalize(find_);
+  sqlite3_finalize(find_under_);
+  if (fd_ != -1) {
+    close(fd_);
+  }
+  sqlite3_close_v2(db_);
+}
+
+bool LibraryWatcher::stopping() {
+  boost::mutex::scoped_lock lock(mutex_);
+  return stopping_;
+}
+
+void LibraryWatcher::Run() {
+  // Paths are recorded as scan records them, from the resolved root, so
+  // that a trailing slash or a symlink doesn't make a second item of a file.
+  for (std::vector<std::string>::const_iterator it = roots_.begin(); it != roots_.end(); ++it) {
+    char resolved[PATH_MAX];
+    if (!realpath(it->c_str(), resolved)) {
+      LOG(WARNING) << "Unable to watch " << *it << ": " << strerror(errno);
+      continue;
+    }
+    AddWatches(resolved, false);
+  }
+  LOG(INFO) << "Watching " << directories_.size() << " library directories";
+
+  boost::posix_time::time_duration debounce = boost::posix_time::milliseconds(FLAGS_watch_debounce_ms);
+  while (!stopping()) {
+    struct pollfd ready;
+    ready.fd = fd_;
+    ready.events = POLLIN;
+    if (poll(&ready, 1, 250) > 0) {
+      ReadEvents();
+    }
+    boost::posix_time::ptime quiet_since = boost::posix_time::microsec_clock::universal_time() - debounce;
+    for (std::map<std::string, boost::posix_time::ptime>::iterator it = pending_.begin(); it != pending_.end(); ) {
+      if (it->second <= quiet_since) {
+        std::string path = it->first;
+        pending_.erase(it++);
+        Update(path);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+void LibraryWatcher::ReadEvents() {
+#ifdef __linux__
+  char buf[64 << 10] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t length = read(fd_, buf, sizeof buf);
+  boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+  for (char *p = buf; length > 0 && p < buf + length; ) {
+    const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(p);
+    p += sizeof(struct inotify_event) + event->len;
+    if (event->mask & IN_Q_OVERFLOW) {
+      LOG(WARNING) << "Missed some changes to the library; run acmd --command=scan to catch up.";
+      continue;
+    }
+    if (event->mask & IN_IGNORED) {
+      directories_.erase(event->wd);
+      continue;
+    }
+    std::map<int, std::string>::const_iterator directory = directories_.find(event->wd);
+    if (directory == directories_.end() || !event->len) {
+      continue;
+    }
+    // A new file is looked at once it has been written and closed; a new
+    // directory straight away (after the debounce), to watch it in time.
+    if ((event->mask & IN_CREATE) && !(event->mask & IN_ISDIR)) {
+      continue;
+    }
+    pending_[Child(directory->second, event->name)] = now;
+  }
+#endif
+}
+
+std::string LibraryWatcher::Child(const std::string& directory, const char *name) {
+  return (directory == "/" ? directory : directory + "/") + name;
+}
+
+// Watches directory and everything under it, adding any files found to the
+// library if add_files.  Like find, symlinks aren't followed.
+void LibraryWatcher::AddWatches(const std::string& directory, bool add_files) {
+#ifdef __linux__
+  int wd = inotify_add_watch(fd_, directory.c_str(),
+      IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+  if (wd == -1) {
+    LOG(WARNING) << "Unable to watch " << directory << ": " << strerror(errno)
+                 << (errno == ENOSPC ? " (raise fs.inotify.max_user_watches?)" : "");
+    return;
+  }
+  directories_[wd] = directory;
+#endif
+  DIR *dir = opendir(directory.c_str());
+  if (!dir) {
+    return;
+  }
+  while (struct dirent *entry = readdir(dir)) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+    std::string path = Child(directory, entry->d_name);
+    struct stat info;
+    if (lstat(path.c_str(), &info)) {
+      continue;
+    }
+    if (S_ISDIR(info.st_mode)) {
+      AddWatches(path, add_files);
+    } else if (add_files && S_ISREG(info.st_mode)) {
+      UpdateFile(path, info);
+    }
+  }
+  closedir(dir);
+}
+
+// Brings the library up to date with whatever is now at path.
+void LibraryWatcher::Update(const std::string& path) {
+  struct stat info;
+  if (lstat(path.c_str(), &info)) {
+    MarkMissing(path);
+  } else if (S_ISDIR(info.st_mode)) {
+    AddWatches(path, true);
+  } else if (S_ISREG(info.st_mode)) {
+    UpdateFile(path, info);
+  }
+}
+
+void LibraryWatcher::UpdateFile(const std::string& path, const struct stat& info) {
+  sqlite3_bind_text(fingerprint_, 1, path.data(), path.size(), SQLITE_STATIC);
+  bool unchanged = false;
+  sqlite3_int64 fingerprinted = -1;
+  if (sqlite3_step(fingerprint_) == SQLITE_ROW) {
+    unchanged = sqlite3_column_int64(fingerprint_, 0) == sqlite3_int64(info.st_ino) &&
+                sqlite3_column_int64(fingerprint_, 1) == sqlite3_int64(info.st_size) &&
+                sqlite3_column_int64(fingerprint_, 2) == sqlite3_int64(info.st_mtime);
+    if (sqlite3_column_type(fingerprint_, 3) == SQLITE_INTEGER) {
+      fingerprinted = sqlite3_column_int64(fingerprint_, 3);
+    }
+  }
+  sqlite3_reset(fingerprint_);
+  if (unchanged) {
+    // Moved back, say.
+    if (fingerprinted >= 0) {
+      Catalog::get()->SetMissing(db_, fingerprinted, false);
+    }
+    return;
+  }
+
+  sqlite3_bind_text(find_, 1, path.data(), path.size(), SQLITE_STATIC);
+  sqlite3_int64 id = sqlite3_step(find_) == SQLITE_ROW ? sqlite3_column_int64(find_, 0) : -1;
+  sqlite3_reset(find_);
+
+  std::vector<automation::PlayableItem> items(1);
+  items[0].set_filename(path);
+  // As in Ingest::Identify, a new file with the content hash of an item
+  // shares the item only if the bytes agree, and takes it over only if
+  // the item's file has gone and the new one lasts as long.
+  sqlite3_int64 hash;
+  automation::PlayableItem known;
+  bool copy = false;
+  if (ContentHash(path, &hash)) {
+    items[0].set_contenthash(hash);
+    if (id < 0 && index_.Find(hash, &known)) {
+      if (!access(known.filename().c_str(), F_OK)) {
+        copy = SameContent(path, known.filename());
+        if (copy) {
+          id = known.playableitemid();
+        }
+      } else {
+        items[0].set_duration(PlayableItem::MeasureDuration(path));
+        if (items[0].duration() == known.duration()) {
+          id = known.playableitemid();  // Moved here.
+        }
+      }
+    }
+  }
+  if (!copy && !items[0].has_duration()) {
+    items[0].set_duration(PlayableItem::MeasureDuration(path));
+  }
+  if (copy) {
+    LOG(INFO) << "Library item " << id << " is also " << path;
+  } else if (items[0].duration() > 0) {
+    std::vector<automation::RowError> errors;
+    if (id >= 0) {
+      items[0].set_playableitemid(id);
+      store_.UpdateBatch(items.begin(), items.end(), &errors);
+    } else {
+      store_.InsertBatch(items.begin(), items.end(), &errors);
+    }
+    if (!errors.empty()) {
+      LOG(WARNING) << "Unable to store " << path << ": " << errors[0].message;
+      return;
+    }
+    id = items[0].playableitemid();
+    Catalog::get()->SetMissing(db_, id, false);
+    LOG(INFO) << "Library item " << id << " is now " << path << " (" << items[0].duration() << "s)";
+  } else if (id >= 0) {
+    // As scan does, keep the old fingerprint, so that the file is looked
+    // at again rather than taken for unchanged.
+    Catalog::get()->SetMissing(db_, id, true);
+    LOG(WARNING) << "Library item " << id << " has changed and can no longer be played: " << path;
+    return;
+  }
+
+  sqlite3_bind_text(record_, 1, path.data(), path.size(), SQLITE_STATIC);
+  sqlite3_bind_int64(record_, 2, info.st_ino);
+  sqlite3_bind_int64(record_, 3, info.st_size);
+  sqlite3_bind_int64(record_, 4, info.st_mtime);
+  if (id >= 0) {
+    sqlite3_bind_int64(record_, 5, id);
+  } else {
+    sqlite3_bind_null(record_, 5);
+  }
+  if (sqlite3_step(record_) != SQLITE_DONE) {
+    LOG(WARNING) << "Unable to record fingerprint of " << path << ": " << sqlite3_errmsg(db_);
+  }
+  sqlite3_reset(record_);
+}
+
+// Marks the items for path, or for anything under it if it was a
+// directory, as missing, unless a copy is left (see Catalog::FileGone).
+void LibraryWatcher::MarkMissing(const std::string& path) {
+  std::vector<std::pair<sqlite3_int64, std::string> > gone;
+  sqlite3_bind_text(find_under_, 1, path.data(), path.size(), SQLITE_STATIC);
+  while (sqlite3_step(find_under_) == SQLITE_ROW) {
+    gone.push_back(std::make_pair(sqlite3_column_int64(find_under_, 0),
+                                  reinterpret_cast<const char *>(sqlite3_column_text(find_under_, 1))));
+  }
+  sqlite3_reset(find_under_);
+
+  for (std::vector<std::pair<sqlite3_int64, std::string> >::iterator it = gone.begin(); it != gone.end(); ++it) {
+    Catalog::get()->FileGone(db_, it->first, it->second);
+  }
+}
@@ -0,0 +1,88 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef LIBRARYWATCHER_H
+#define LIBRARYWATCHER_H
+
+#include <sys/stat.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "base.h"
+#include "contenthash.h"
+#include "playableitem.pb.h"
+#include "protostore.h"
+#include "sqlite3.h"
+
+// LibraryWatcher keeps the library in step with directories on disk while
+// the daemon runs, so that nobody has to run acmd for new files to turn up
+// and a deleted file is never put on air.  It uses inotify, and waits until
+// a path has been quiet for --watch_debounce_ms before looking at it (a file
+// being copied in changes many times).  Then, on its own thread:
+//
+//  - a new or changed file has its duration worked out and is added to the
+//    library, or its item updated (or, as acmd does, takes over or shares
+//    the item of a file with the same content);
+//  - a file or directory that has gone has its items marked missing (see
+//    Catalog::SetMissing), so that playlists pass over them, unless a copy
+//    is left;
+//  - a new directory is watched too, and everything in it added.
+//
+// Fingerprints are recorded just as acmd --command=scan records them, so a
+// later scan doesn't probe the same files again.  Changes made while the
+// daemon isn't running are not noticed; run a scan to catch up with those.
+// inotify is Linux only; elsewhere the watcher logs that and does nothing.
+class LibraryWatcher {
+ public:
+  // Takes ownership of db.
+  LibraryWatcher(sqlite3 *db, const std::vector<std::string>& roots);
+  ~LibraryWatcher();
+
+ private:
+  void Run();
+  bool stopping();
+  void ReadEvents();
+  void AddWatches(const std::string& directory, bool add_files);
+  static std::string Child(const std::string& directory, const char *name);
+  void Update(const std::string& path);
+  void UpdateFile(const std::string& path, const struct stat& info);
+  void MarkMissing(const std::string& path);
+
+  sqlite3 *db_;
+  const std::vector<std::string> roots_;
+  int fd_;
+  sqlite3_stmt *fingerprint_;
+  sqlite3_stmt *record_;
+  sqlite3_stmt *find_;
+  sqlite3_stmt *find_under_;
+  automation::ProtoStore<automation::PlayableItem> store_;
+  ContentIndex index_;
+
+  // Only the watcher's thread touches these.
+  std::map<int, std::string> directories_;                     // By watch descriptor.
+  std::map<std::string, boost::posix_time::ptime> pending_;    // Path to its latest event.
+
+  boost::mutex mutex_;  // Guards stopping_.
+  bool stopping_;
+
+  boost::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(LibraryWatcher);
+};
+
+#endif
@@ -15,17 +15,18 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <google/protobuf/descriptor.h>
 #include <glog/logging.h>
 #include "sqlite3.h"
 #include "boost/algorithm/string/join.hpp"
-#include "boost/algorithm/string/split.hpp"
-#include "boost/algorithm/string/classification.hpp"
 #include <boost/thread/mutex.hpp>
 #include <string>
 #include <vector>
 #include <google/protobuf/dynamic_message.h>
 #include "messagestore.h"
+#include "protostore.pb.h"
 #include <exception>
 
 using std::vector;
@@ -41,99 +42,256 @@ class constraintexception_decl : public std::exception {
 } ConstraintException;
  
 
-MessageStore::MessageStore(sqlite3 *db, const Descriptor *desc, const std::string& table) : db_(db), desc_(desc), lookup_by_id_(NULL), table_(table), never_save_(false) {
+typedef std::map<const Descriptor *, WriteObserver *> WriteObservers;
+static boost::mutex write_observers_mutex;
+static WriteObservers write_observers; // Guarded by write_observers_mutex
+
+void MessageStore::SetWriteObserver(const Descriptor *desc, WriteObserver *observer) {
+  boost::mutex::scoped_lock lock(write_observers_mutex);
+  if (observer) {
+    write_observers[desc] = observer;
+  } else {
+    write_observers.erase(desc);
+  }
+}
+
+void MessageStore::NotifyWritten(const Message& row) {
+  boost::mutex::scoped_lock lock(write_observers_mutex);
+  WriteObservers::iterator it = write_observers.find(row.GetDescriptor());
+  if (it == write_observers.end()) {
+    return;
+  }
+  WriteObserver *observer = it->second;
+  lock.unlock();
+  observer->RowWritten(row);
+}
+
+MessageStore::MessageStore(sqlite3 *db, const Descriptor *desc, const std::string& table) : db_(db), desc_(desc), row_mapper_(NULL), table_(table), never_save_(false) {
+  CHECK(desc_->field_count() <= 64) << "Field masks only cover 64 fields";
 }
 void MessageStore::NeverSave() {
   never_save_ = true;
 }
 
 void MessageStore::SetTable(const std::string& table) {
-  if (lookup_by_id_ && table_ != table) {
-    sqlite3_finalize(lookup_by_id_);
-    lookup_by_id_ = NULL;
-  }
+  // Statements are cached per table, so there is nothing to invalidate here.
   table_ = table;
 }
+void MessageStore::SetRowMapper(const RowMapper *mapper) {
+  if (mapper) {
+    // A mapper generated from an older .proto would bind and read the wrong
+    // fields; insist that it was generated from the one we were built with.
+    CHECK(mapper->column_count() == desc_->field_count()) << "Stale row mapper for " << desc_->full_name();
+    for (int i = 0; i < desc_->field_count(); ++i) {
+      CHECK(desc_->field(i)->name() == mapper->columns()[i]) << "Stale row mapper for " << desc_->full_name();
+    }
+  }
+  row_mapper_ = mapper;
+}
 MessageStore::~MessageStore() {
-  if (lookup_by_id_) {
-    sqlite3_finalize(lookup_by_id_);
-    lookup_by_id_ = NULL;
+  for (StatementCache::iterator it = statements_.begin(); it != statements_.end(); ++it) {
+    sqlite3_finalize(it->second->ps);
+    delete it->second;
   }
+  statements_.clear();
 }
-bool MessageStore::LoadById(Message* lookup, int64_t id) {
-  if (lookup_by_id_ == NULL) {
-    std::string query = "SELECT * from " + table_ + " WHERE " + desc_->FindFieldByNumber(1)->name() + " = ?";
-    CHECK(SQLITE_OK == sqlite3_prepare_v2(CHECK_NOTNULL(db_), query.c_str(), -1, &lookup_by_id_, NULL)) << sqlite3_errmsg(db_);
+
+uint64_t MessageStore::FieldMask(const Message& object, bool include_repeated) const {
+  const Reflection* reflection = object.GetReflection();
+  vector<const FieldDescriptor *> fields;
+  reflection->ListFields(object, &fields);
+  uint64_t mask = 0;
+  for (vector<const FieldDescriptor *>::iterator it = fields.begin() ; it != fields.end(); ++it) {
+    if ((*it)->is_repeated() && !include_repeated) {
+      continue;
+    }
+    mask |= (uint64_t) 1 << (*it)->index();
+  }
+  return mask;
+}
+
+// Builds the SQL for a statement.  For LOAD, mask is the set of fields in the
+// WHERE clause; for INSERT, REPLACE and UPDATE it is the set of (non-repeated)
+// columns written; for the _REPEATED variants it is the single repeated field
+// whose join table is written.  LOAD_BY_ID and LOAD_ALL ignore it.
+std::string MessageStore::BuildQuery(Operation op, const std::string& table, uint64_t mask) const {
+  vector<std::string> field_names, fmt_string, update_portion;
+  for (int i = 0; i < desc_->field_count(); ++i) {
+    if (!(mask & ((uint64_t) 1 << i))) {
+      continue;
+    }
+    const FieldDescriptor *fd = desc_->field(i);
+    field_names.push_back(fd->name());
+    fmt_string.push_back("?");
+    update_portion.push_back(fd->name() + " = ? ");
+  }
+  const std::string& id_name = desc_->field(0)->name();
+
+  switch (op) {
+    case LOAD:
+      if (field_names.empty()) {
+        return "SELECT * from " + table + " WHERE 1";
+      }
+      return "SELECT * from " + table + " WHERE " + boost::algorithm::join(update_portion, "AND ");
+    case LOAD_BY_ID:
+      return "SELECT * from " + table + " WHERE " + id_name + " = ?";
+    case LOAD_ALL:
+      return "SELECT * from " + table + " LIMIT ? OFFSET ?";
+    case INSERT:
+    case REPLACE:
+      if (field_names.empty()) {
+        return std::string(op == INSERT ? "INSERT" : "REPLACE") + " INTO " + table + " DEFAULT VALUES";
+      }
+      return std::string(op == INSERT ? "INSERT" : "REPLACE") + " INTO " + table +
+             " (" + boost::algorithm::join(field_names, ",") + ") VALUES (" + boost::algorithm::join(fmt_string, ",") + ")";
+    case UPDATE:
+      return "UPDATE " + table + " SET " + boost::algorithm::join(update_portion, ",") + " WHERE " + id_name + " = ?";
+    case INSERT_REPEATED:
+    case REPLACE_REPEATED:
+      CHECK(field_names.size() == 1);
+      return std::string(op == INSERT_REPEATED ? "INSERT OR IGNORE" : "REPLACE") + " INTO " + table + "_" + field_names[0] +
+             " (" + id_name + "," + field_names[0] + " ) VALUES (?, ?)";
+    case DELETE_REPEATED:
+      CHECK(field_names.size() == 1);
+      return "DELETE FROM " + table + "_" + field_names[0] + " WHERE " + id_name + " = ? AND " + field_names[0] + " = ?";
+    case SAVEPOINT:
+      return "SAVEPOINT batchrow";
+    case RELEASE_SAVEPOINT:
+      return "RELEASE batchrow";
+    case ROLLBACK_SAVEPOINT:
+      return "ROLLBACK TO batchrow";
+    case QUERY:
+      return table;
+  }
+  CHECK(false) << "Unknown operation " << op;
+  return "";
+}
+
+void MessageStore::PlanColumns(sqlite3_stmt *ps, vector<const FieldDescriptor *> *columns) const {
+  columns->clear();
+  for (int i = 0; i < sqlite3_column_count(ps); ++i) {
+    const FieldDescriptor *fd = desc_->FindFieldByName(sqlite3_column_name(ps, i));
+    CHECK(fd != NULL) << "No field " << sqlite3_column_name(ps, i) << " found on proto.";
+    columns->push_back(fd);
+  }
+}
+
+PreparedStatement* MessageStore::Statement(Operation op, const std::string& table, uint64_t mask) {
+  StatementKey key(op, table, mask);
+  StatementCache::iterator it = statements_.find(key);
+  if (it != statements_.end()) {
+    return it->second;
   }
 
-  sqlite3_bind_int64(lookup_by_id_, 1, id);
-  bool rval = ProtoFromRows(lookup_by_id_, lookup);
-  sqlite3_reset(lookup_by_id_);
+  std::string query = BuildQuery(op, table, mask);
+  VLOG(75) << "preparing " << query;
+  PreparedStatement *statement = new PreparedStatement;
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(CHECK_NOTNULL(db_), query.c_str(), -1, &statement->ps, NULL)) << sqlite3_errmsg(db_);
+
+  if (op == LOAD || op == INSERT || op == REPLACE || op == UPDATE) {
+    for (int i = 0; i < desc_->field_count(); ++i) {
+      if (mask & ((uint64_t) 1 << i)) {
+        statement->params.push_back(desc_->field(i));
+      }
+    }
+  }
+  if (op == LOAD || op == LOAD_BY_ID || op == LOAD_ALL) {
+    PlanColumns(statement->ps, &statement->columns);
+  }
+  statements_.insert(std::make_pair(key, statement));
+  return statement;
+}
+
+PreparedStatement* MessageStore::Query(const std::string& sql) {
+  return Statement(QUERY, sql, 0);
+}
+
+bool MessageStore::LoadById(Message* lookup, int64_t id) {
+  PreparedStatement *statement = Statement(LOAD_BY_ID, table_, 0);
+
+  sqlite3_bind_int64(statement->ps, 1, id);
+  bool rval = ProtoFromRows(*statement, lookup);
+  sqlite3_reset(statement->ps);
   return rval;
 }
 
 bool MessageStore::Load(Message* lookup) {
-  std::string query = "SELECT * from " + table_ + " WHERE ";
-
   const Reflection* reflection = lookup->GetReflection();
   vector<const FieldDescriptor *> fields;
   reflection->ListFields(*lookup, &fields);
   for (vector<const FieldDescriptor *>::iterator it = fields.begin() ; it != fields.end(); ++it) {
-    const FieldDescriptor* fd = *it;
-    CHECK(!fd->is_repeated()) << "Lookups on repeated fields disallowed";
-    query += fd->name() + " = ?";
-  }
-  if (fields.size() == 0) {
-    query += "1";
-  }
-  
-  sqlite3_stmt *ps;
-  VLOG(75) << "about to query" << query;
-  CHECK(SQLITE_OK == sqlite3_prepare_v2(CHECK_NOTNULL(db_), query.c_str(), -1, &ps, NULL)) << sqlite3_errmsg(db_);
-  BindFromFields(*lookup, ps);  
-  bool result = ProtoFromRows(ps, lookup);
+    CHECK(!(*it)->is_repeated()) << "Lookups on repeated fields disallowed";
+  }
+
+  PreparedStatement *statement = Statement(LOAD, table_, FieldMask(*lookup, false));
+  BindFromFields(*lookup, *statement);
+  bool result = ProtoFromRows(*statement, lookup);
   VLOG(80) << "returning " << lookup->DebugString() << " from load with retval " << result;
-  CHECK(SQLITE_OK == sqlite3_reset(ps));
-  CHECK(SQLITE_OK == sqlite3_finalize(ps));
+  CHECK(SQLITE_OK == sqlite3_reset(statement->ps));
   return result;
 }
 int MessageStore::Insert(Message* value) {
-  return InsertOrReplace(value, "INSERT");
+  return InsertOrReplace(value, INSERT);
 }
 int MessageStore::Replace(Message* value) {
-  return InsertOrReplace(value, "REPLACE");
+  return InsertOrReplace(value, REPLACE);
 }
 int MessageStore::Update(Message* value) {
-  return InsertOrReplace(value, "UPDATE");
+  return InsertOrReplace(value, UPDATE);
 }
 
-int MessageStore::InsertOrReplace(Message* value, std::string cmd) {
+int MessageStore::InsertOrReplace(Message* value, Operation op) {
   if (never_save_) {
     return SQLITE_MISUSE;
   }
-  std::string tablename = value->GetDescriptor()->name();
   VLOG(30) << "InsertOrReplace " << value->DebugString();
 
+  CHECK(SQLITE_OK == sqlite3_exec(db_, "BEGIN TRANSACTION", NULL, NULL, NULL)) << sqlite3_errmsg(db_);
+  if (WriteRow(value, op) == SQLITE_CONSTRAINT) {
+    VLOG(5) << "constraint: rollback";
+    CHECK(SQLITE_OK == sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL));
+    throw ConstraintException;
+  }
+  VLOG(5) << "About to commit";
+  bool result = sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL);
+  if (result != SQLITE_OK) {
+    CHECK(SQLITE_OK == sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL));
+    throw ConstraintException;
+  }
+  NotifyWritten(*value);
+  return result;
+}
+
+// Steps one join table statement for the (id, member) pair.
+static int StepJoinRow(sqlite3 *db, sqlite3_stmt *ps, int64_t id, int64_t member) {
+  sqlite3_bind_int64(ps, 1, id);
+  sqlite3_bind_int64(ps, 2, member);
+  switch (sqlite3_step(ps)) {
+    case SQLITE_CONSTRAINT:
+      sqlite3_reset(ps);
+      return SQLITE_CONSTRAINT;
+    case SQLITE_DONE:
+      break;
+    default:
+      CHECK(false) << "Unknown error " << sqlite3_errmsg(db);
+  }
+  CHECK(SQLITE_OK == sqlite3_reset(ps));
+  return SQLITE_DONE;
+}
+
+// Writes value and (unless write_repeated is false) its repeated fields
+// using the cached statements for op.  No transaction is opened here: on
+// SQLITE_CONSTRAINT the caller must roll back whatever part of the row was
+// already written.
+int MessageStore::WriteRow(Message* value, Operation op, bool write_repeated) {
+  std::string tablename = value->GetDescriptor()->name();
+
   const Reflection* reflection = value->GetReflection();
   vector<const FieldDescriptor *> fields;
-  vector<std::string> field_names, fmt_string, update_portion;
   reflection->ListFields(*value, &fields);
-  for (vector<const FieldDescriptor *>::iterator it = fields.begin() ; it != fields.end(); ++it) {
-    const FieldDescriptor* fd = *it;
-    if (fd->is_repeated()) {
-      continue; // we handle these later
-    }
-    field_names.push_back(fd->name());
-    fmt_string.push_back("?");
-    update_portion.push_back(fd->name() + " = ? ");
-  }
-  std::string field_name_str;
-  field_name_str = boost::algorithm::join(field_names, ",");
-  std::string fmt_str = boost::algorithm::join(fmt_string, ",");
-  std::string update_str = boost::algorithm::join(update_portion, ",");
 
   // We may or may not even be a table with an id
-  int local_id = 0;
+  int64_t local_id = 0;
 
   if (value->GetDescriptor()->field(0)->type() == FieldDescriptor::TYPE_INT64) {
     if (reflection->HasField(*value, value->GetDescriptor()->field(0))) {
@@ -143,34 +301,22 @@ int MessageStore::InsertOrReplace(Message* value, std::string cmd) {
       local_id = -1;
     }
   }
-
-  CHECK(SQLITE_OK == sqlite3_exec(db_, "BEGIN TRANSACTION", NULL, NULL, NULL)) << sqlite3_errmsg(db_);
-  std::string query;
-
-  if (cmd == "INSERT" || cmd == "REPLACE") { 
-    query = cmd +  " INTO " + tablename + " ("+field_name_str+") VALUES ("+fmt_str+")";
-  } else if (cmd == "UPDATE") {
-    query = "UPDATE " + tablename + " SET " + update_str + " WHERE " + value->GetDescriptor()->field(0)->name() + " = ?";
+  if (op == UPDATE) {
     CHECK(local_id != -1) << "Cannot do an update without an ID.";
   }
 
-  sqlite3_stmt *ps;
-
-  VLOG(99) << query;
-  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_, query.c_str(), -1, &ps, NULL)) << sqlite3_errmsg(db_);
-  
-  int next_field = BindFromFields(*value, ps);  
+  PreparedStatement *statement = Statement(op, tablename, FieldMask(*value, false));
+  sqlite3_stmt *ps = statement->ps;
+  int next_field = BindFromFields(*value, *statement);
 
-  if (cmd == "UPDATE") {
+  if (op == UPDATE) {
     sqlite3_bind_int64(ps, next_field, local_id);
   }
 
   switch (sqlite3_step(ps)) {
   case SQLITE_CONSTRAINT:
-    CHECK(SQLITE_OK == sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL));
-    sqlite3_finalize(ps);
-    throw ConstraintException;
-    break;
+    sqlite3_reset(ps);
+    return SQLITE_CONSTRAINT;
   case SQLITE_OK:
   case SQLITE_DONE:
     break;
@@ -178,77 +324,130 @@ int MessageStore::InsertOrReplace(Message* value, std::string cmd) {
     CHECK(false) << sqlite3_errmsg(db_);
     break;
   }
-  CHECK(SQLITE_OK == sqlite3_finalize(ps));
+  CHECK(SQLITE_OK == sqlite3_reset(ps));
   if (local_id == -1) {
     local_id = sqlite3_last_insert_rowid(db_);
     reflection->SetInt64(value, value->GetDescriptor()->field(0), local_id);
   } 
 
-  for (vector<const FieldDescriptor *>::iterator it = fields.begin(); it != fields.end(); ++it) {
+  for (vector<const FieldDescriptor *>::iterator it = fields.begin(); write_repeated && it != fields.end(); ++it) {
     const FieldDescriptor* fd = *it;
     if (!fd->is_repeated()) {
       continue; // we handled these in the root insert
     }
-    std::string query;
-    if (cmd == "INSERT" || cmd == "UPDATE") {
-      query = "INSERT OR IGNORE";
-    } else {
-      query = "REPLACE";
-    }
-    query += " INTO " + tablename + "_" + fd->name() + " (" + value->GetDescriptor()->field(0)->name() + "," + fd->name() + " ) VALUES (?, ?)";
-    VLOG(9) << query;
-    VLOG(9) << field_names[0];
-    CHECK(SQLITE_OK == sqlite3_prepare_v2(db_, query.c_str(), -1, &ps, NULL)) << sqlite3_errmsg(db_);
+    ps = Statement(op == REPLACE ? REPLACE_REPEATED : INSERT_REPEATED, tablename, (uint64_t) 1 << fd->index())->ps;
     for (int i = 0; i < reflection->FieldSize(*value, fd); ++i) {
-      sqlite3_bind_int64(ps, 1, local_id);
-      sqlite3_bind_int64(ps, 2, reflection->GetRepeatedInt64(*value, fd, i));
-      switch (sqlite3_step(ps)) {
-        case SQLITE_CONSTRAINT:
-          VLOG(5) << "constraint: rollback";
-          CHECK(SQLITE_OK == sqlite3_finalize(ps));
-          CHECK(SQLITE_OK == sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL));
-          throw ConstraintException;
-          break;
-        case SQLITE_DONE:
-          break;
-        default:
-          CHECK(false) << "Unknown error " << sqlite3_errmsg(db_);
+      if (StepJoinRow(db_, ps, local_id, reflection->GetRepeatedInt64(*value, fd, i)) == SQLITE_CONSTRAINT) {
+        return SQLITE_CONSTRAINT;
       }
-      CHECK(SQLITE_OK == sqlite3_reset(ps));
     }
-    VLOG(5) << "About to finalize";
-    CHECK(SQLITE_OK == sqlite3_finalize(ps)) << sqlite3_errmsg(db_);
   }
-  VLOG(5) << "About to commit";
-  bool result = sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL);
-  if (result != SQLITE_OK) {
+  return SQLITE_DONE;
+}
+
+int MessageStore::UpdateWithDelta(Message* value, const FieldDescriptor *fd,
+                                  const vector<int64_t>& added, const vector<int64_t>& removed,
+                                  vector<RowError> *errors) {
+  if (never_save_) {
+    return SQLITE_MISUSE;
+  }
+  CHECK(fd->is_repeated() && fd->type() == FieldDescriptor::TYPE_INT64) << fd->name() << " is not a repeated int64";
+  const std::string& tablename = value->GetDescriptor()->name();
+  int64_t local_id = value->GetReflection()->GetInt64(*value, value->GetDescriptor()->field(0));
+  VLOG(30) << "UpdateWithDelta " << tablename << " " << local_id << ": +" << added.size() << " -" << removed.size();
+
+  CHECK(SQLITE_OK == sqlite3_exec(db_, "BEGIN TRANSACTION", NULL, NULL, NULL)) << sqlite3_errmsg(db_);
+  int result = WriteRow(value, UPDATE, false);
+  sqlite3_stmt *ps = Statement(DELETE_REPEATED, tablename, (uint64_t) 1 << fd->index())->ps;
+  for (vector<int64_t>::const_iterator it = removed.begin(); result != SQLITE_CONSTRAINT && it != removed.end(); ++it) {
+    result = StepJoinRow(db_, ps, local_id, *it);
+  }
+  ps = Statement(INSERT_REPEATED, tablename, (uint64_t) 1 << fd->index())->ps;
+  for (vector<int64_t>::const_iterator it = added.begin(); result != SQLITE_CONSTRAINT && it != added.end(); ++it) {
+    result = StepJoinRow(db_, ps, local_id, *it);
+    // A failed statement undoes only itself, so the transaction carries on
+    // without the row.
+    if (result == SQLITE_CONSTRAINT && errors) {
+      VLOG(5) << "constraint on member " << *it << ": " << sqlite3_errmsg(db_);
+      errors->push_back(RowError(it - added.begin(), SQLITE_CONSTRAINT, sqlite3_errmsg(db_)));
+      result = SQLITE_DONE;
+    }
+  }
+  if (result == SQLITE_CONSTRAINT || sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+    VLOG(5) << "constraint: rollback " << sqlite3_errmsg(db_);
     CHECK(SQLITE_OK == sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL));
+    if (errors) {
+      return SQLITE_CONSTRAINT;
+    }
     throw ConstraintException;
   }
-  return result;
+  NotifyWritten(*value);
+  return SQLITE_OK;
 }
-int MessageStore::BindFromFields(const Message& object, sqlite3_stmt *ps) { 
+
+void MessageStore::BeginBatch() {
+  CHECK(SQLITE_OK == sqlite3_exec(db_, "BEGIN TRANSACTION", NULL, NULL, NULL)) << sqlite3_errmsg(db_);
+}
+
+bool MessageStore::WriteBatchRow(Message* value, Operation op, size_t index, vector<RowError> *errors) {
+  if (never_save_) {
+    errors->push_back(RowError(index, SQLITE_MISUSE, "Store is never saved."));
+    return false;
+  }
+  const Reflection* reflection = value->GetReflection();
+  const FieldDescriptor *id_field = value->GetDescriptor()->field(0);
+  bool had_id = id_field->type() != FieldDescriptor::TYPE_INT64 || reflection->HasField(*value, id_field);
+
+  sqlite3_stmt *savepoint = Statement(SAVEPOINT, "", 0)->ps;
+  CHECK(SQLITE_DONE == sqlite3_step(savepoint)) << sqlite3_errmsg(db_);
+  sqlite3_reset(savepoint);
+
+  bool written = WriteRow(value, op) != SQLITE_CONSTRAINT;
+  if (!written) {
+    VLOG(5) << "constraint on batch row " << index << ": " << sqlite3_errmsg(db_);
+    errors->push_back(RowError(index, SQLITE_CONSTRAINT, sqlite3_errmsg(db_)));
+    sqlite3_stmt *rollback = Statement(ROLLBACK_SAVEPOINT, "", 0)->ps;
+    CHECK(SQLITE_DONE == sqlite3_step(rollback)) << sqlite3_errmsg(db_);
+    sqlite3_reset(rollback);
+    if (!had_id) {
+      reflection->ClearField(value, id_field);
+    }
+  }
+  sqlite3_stmt *release = Statement(RELEASE_SAVEPOINT, "", 0)->ps;
+  CHECK(SQLITE_DONE == sqlite3_step(release)) << sqlite3_errmsg(db_);
+  sqlite3_reset(release);
+  return written;
+}
+
+bool MessageStore::CommitBatch(std::string *error) {
+  if (sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+    *error = sqlite3_errmsg(db_);
+    LOG(WARNING) << "Batch commit failed: " << *error;
+    CHECK(SQLITE_OK == sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL));
+    return false;
+  }
+  return true;
+}
+int MessageStore::BindFromFields(const Message& object, const PreparedStatement& statement) { 
+  if (row_mapper_) {
+    return row_mapper_->Bind(object, statement);
+  }
   const Reflection* reflection = object.GetReflection();
-  vector<const FieldDescriptor *> fields;
-  reflection->ListFields(object, &fields);
   int i = 1;
-  for (vector<const FieldDescriptor *>::iterator it = fields.begin() ; it != fields.end(); ++it, ++i) {
+  for (vector<const FieldDescriptor *>::const_iterator it = statement.params.begin() ; it != statement.params.end(); ++it, ++i) {
     const FieldDescriptor* fd = *it;
-    if (fd->is_repeated()) {
-      continue;
-    }
     std::string fieldval;
     switch (fd->type()) {
       case FieldDescriptor::TYPE_INT32:
-        sqlite3_bind_int(ps, i, reflection->GetInt32(object, fd));
+        sqlite3_bind_int(statement.ps, i, reflection->GetInt32(object, fd));
         break;
       case FieldDescriptor::TYPE_INT64:
-        sqlite3_bind_int64(ps, i, reflection->GetInt64(object, fd));
+        sqlite3_bind_int64(statement.ps, i, reflection->GetInt64(object, fd));
         break;
       case FieldDescriptor::TYPE_BYTES:
       case FieldDescriptor::TYPE_STRING:
         fieldval = reflection->GetString(object, fd);
-        sqlite3_bind_text(ps, i, fieldval.c_str(), fieldval.size(), SQLITE_TRANSIENT);
+        sqlite3_bind_text(statement.ps, i, fieldval.c_str(), fieldval.size(), SQLITE_TRANSIENT);
         break;
       default:
         CHECK(false) << "Unsupported " << fd->type();
@@ -258,30 +457,40 @@ int MessageStore::BindFromFields(const Message& object, sqlite3_stmt *ps) {
   return i;
 }
 bool MessageStore::ProtoFromRows(sqlite3_stmt *ps, Message *result) {
+  // One-off statements (not from Statement()) get planned on every call.
+  PreparedStatement statement;
+  statement.ps = ps;
+  PlanColumns(ps, &statement.columns);
+  return ProtoFromRows(statement, result);
+}
+bool MessageStore::ProtoFromRows(const PreparedStatement& statement, Message *result) {
   const Reflection* reflection = result->GetReflection();
+  sqlite3_stmt *ps = statement.ps;
   if (SQLITE_ROW == sqlite3_step(ps)) {
+    if (row_mapper_) {
+      row_mapper_->Read(statement, result);
+      LoadRepeatedSources(statement, result);
+      return true;
+    }
     const char *blob;
-    vector<string> ids;
+    int64_t id;
     std::string stringblob;
-    for(int i = 0; i < sqlite3_column_count(ps); ++i) {
-      //CHECK(sqlite3_column_table_name(ps, i) == table_) << sqlite3_column_table_name(ps, i) << " does not match " << table_;
-      const FieldDescriptor *fd = desc_->FindFieldByName(sqlite3_column_name(ps, i));
-      CHECK(fd != NULL) << "No field " << sqlite3_column_name(ps, i) << " found on proto.";
+    for(size_t i = 0; i < statement.columns.size(); ++i) {
+      const FieldDescriptor *fd = statement.columns[i];
       switch (fd->type()) {
       case FieldDescriptor::TYPE_INT32:
         reflection->SetInt32(result, fd, sqlite3_column_int(ps, i));
         break;
       case FieldDescriptor::TYPE_INT64:
         if (!fd->is_repeated()) {
-          reflection->SetInt64(result, fd, sqlite3_column_int(ps, i));
+          reflection->SetInt64(result, fd, sqlite3_column_int64(ps, i));
           break;
         }
-        // We can do joins by getting a group_concat of IDs via a view, so special case that
-        blob = (char *)sqlite3_column_blob(ps, i);
-        stringblob = string(blob, sqlite3_column_bytes(ps, i));
-        boost::algorithm::split(ids, stringblob, boost::is_any_of(","));
-        for (vector<string>::iterator it = ids.begin(); it != ids.end(); ++it) {
-          reflection->AddInt64(result, fd, atoll(it->c_str()));
+        // Some views still hand us a group_concat of IDs; walk it in place
+        // rather than splitting it into strings.
+        blob = (const char *) sqlite3_column_text(ps, i);
+        while (NextListedId(&blob, &id)) {
+          reflection->AddInt64(result, fd, id);
         }
         break;
       case FieldDescriptor::TYPE_STRING:
@@ -294,9 +503,88 @@ bool MessageStore::ProtoFromRows(sqlite3_stmt *ps, Message *result) {
         CHECK(false) << "Unknown type " << fd->type();
       }
     }
+    LoadRepeatedSources(statement, result);
     return true;
   }
   return false;
 }
 
+bool NextListedId(const char **text, int64_t *id) {
+  // sqlite3_column_text is always NUL-terminated (or NULL).
+  if (!*text || !**text) {
+    return false;
+  }
+  char *next;
+  *id = strtoll(*text, &next, 10);
+  if (next == *text) {
+    return false;
+  }
+  *text = (*next == ',') ? next + 1 : next;
+  return true;
+}
+
+void MessageStore::SetRepeatedSource(const std::string& field, const std::string& sql) {
+  const FieldDescriptor *fd = CHECK_NOTNULL(desc_->FindFieldByName(field));
+  CHECK(fd->is_repeated() && fd->type() == FieldDescriptor::TYPE_INT64) << field << " is not a repeated int64";
+  if (sql.empty()) {
+    repeated_sources_.erase(fd);
+  } else {
+    repeated_sources_[fd] = sql;
+  }
+}
+
+void MessageStore::LoadRepeatedSources(const PreparedStatement& statement, Message *result) {
+  if (repeated_sources_.empty()) {
+    return;
+  }
+  const Reflection* reflection = result->GetReflection();
+  const FieldDescriptor *id_field = desc_->field(0);
+  for (RepeatedSources::iterator it = repeated_sources_.begin(); it != repeated_sources_.end(); ++it) {
+    const FieldDescriptor *fd = it->first;
+    if (std::find(statement.columns.begin(), statement.columns.end(), fd) != statement.columns.end()) {
+      continue; // the row already carried it
+    }
+    sqlite3_stmt *ps = Query(it->second)->ps;
+    sqlite3_bind_int64(ps, 1, reflection->GetInt64(*result, id_field));
+    while (sqlite3_step(ps) == SQLITE_ROW) {
+      reflection->AddInt64(result, fd, sqlite3_column_int64(ps, 0));
+    }
+    sqlite3_reset(ps);
+  }
+}
+
+std::string EncodePageToken(const PageToken& token) {
+  static const char kHex[] = "0123456789abcdef";
+  std::string raw = token.SerializeAsString();
+  std::string encoded;
+  for (std::string::iterator it = raw.begin(); it != raw.end(); ++it) {
+    encoded += kHex[(*it >> 4) & 0xf];
+    encoded += kHex[*it & 0xf];
+  }
+  return encoded;
+}
+
+static int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool DecodePageToken(const std::string& encoded, PageToken *token) {
+  token->Clear();
+  if (encoded.size() % 2) {
+    return false;
+  }
+  std::string raw;
+  for (size_t i = 0; i < encoded.size(); i += 2) {
+    int high = HexValue(encoded[i]), low = HexValue(encoded[i + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    raw += (char) (high << 4 | low);
+  }
+  return token->ParseFromString(raw);
+}
+
 } // namespace automation
@@ -18,13 +18,72 @@
 #define _MESSAGESTORE_H
 
 #include "sqlite3.h"
+#include <stdint.h>
+#include <map>
 #include <string>
+#include <vector>
 #include <google/protobuf/dynamic_message.h>
 
 using namespace google::protobuf;
 
 namespace automation {
 
+// A prepared statement along with its precomputed mapping to proto fields.
+// params holds the fields bound to each '?' in order; columns holds the
+// field for each result column (reads only).  Both are built once, when
+// the statement is first prepared, so that the per-row paths never have
+// to touch the descriptor by name.
+struct PreparedStatement {
+  PreparedStatement() : ps(NULL) {}
+  sqlite3_stmt *ps;
+  std::vector<const FieldDescriptor *> params;
+  std::vector<const FieldDescriptor *> columns;
+};
+
+// A row from a batch write that could not be stored.  index is the row's
+// position in the input range, code is the sqlite result code.
+struct RowError {
+  RowError(size_t i, int c, const std::string& m) : index(i), code(c), message(m) {}
+  size_t index;
+  int code;
+  std::string message;
+};
+
+// A type-specific replacement for the reflection in BindFromFields and
+// ProtoFromRows, generated per message by protoc-gen-rowmap (see the
+// *.rowmap.h files).  Both methods are handed the statement's plan, so all
+// that is left for them is calling the right accessor for each field.
+class RowMapper {
+ public:
+  virtual ~RowMapper() {}
+  // The message's field names in field order, as of generation time.
+  virtual int column_count() const = 0;
+  virtual const char* const* columns() const = 0;
+  // As BindFromFields.
+  virtual int Bind(const Message& object, const PreparedStatement& statement) const = 0;
+  // Reads the row statement has just stepped onto into result.
+  virtual void Read(const PreparedStatement& statement, Message *result) const = 0;
+};
+
+// RowMapperFor<T>::Get() is the generated mapper for T, or NULL if there is
+// none, in which case stores of T fall back to reflection.
+template<class T> struct RowMapperFor {
+  static const RowMapper* Get() { return NULL; }
+};
+
+// Reads the next ID from a group_concat list of IDs, advancing *text past
+// it.  Returns false at the end of the list.
+bool NextListedId(const char **text, int64_t *id);
+
+// Told about rows written through any MessageStore once they have been
+// committed, so that in-memory copies of a table can keep up.  See
+// MessageStore::SetWriteObserver.
+class WriteObserver {
+ public:
+  virtual ~WriteObserver() {}
+  virtual void RowWritten(const Message& row) = 0;
+};
+
 class MessageStore {
  public:
   MessageStore(sqlite3 *db, const Descriptor *desc, const std::string& tablename);
@@ -36,17 +95,101 @@ class MessageStore {
   void NeverSave();
   ~MessageStore();
 
+  // Number of rows written per transaction by the batch APIs on ProtoStore.
+  static const size_t kDefaultChunkSize = 1000;
+
+  // Calls observer with every row of desc's type committed by any store from
+  // now on; NULL stops.
+  static void SetWriteObserver(const Descriptor *desc, WriteObserver *observer);
+
  protected:
+  enum Operation {
+    LOAD,
+    LOAD_BY_ID,
+    LOAD_ALL,
+    INSERT,
+    REPLACE,
+    UPDATE,
+    INSERT_REPEATED,
+    REPLACE_REPEATED,
+    DELETE_REPEATED,
+    SAVEPOINT,
+    RELEASE_SAVEPOINT,
+    ROLLBACK_SAVEPOINT,
+    QUERY,
+  };
+
   void SetTable(const std::string& tablename);
-  int InsertOrReplace(Message* value, std::string cmd);
-  int BindFromFields(const Message& object, sqlite3_stmt *ps);
+  // Use mapper instead of reflection for the per-row work; NULL restores
+  // reflection.
+  void SetRowMapper(const RowMapper *mapper);
+  int InsertOrReplace(Message* value, Operation op);
+  int WriteRow(Message* value, Operation op, bool write_repeated = true);
+  // Saves value's non-repeated columns with an UPDATE, then applies a
+  // membership change to its repeated field fd: join table rows for removed
+  // are deleted and rows for added inserted, leaving every other member
+  // untouched.  Throws ConstraintException, like Replace, on failure.  Given
+  // errors, a member of added that the database rejects is left out and
+  // reported there instead (index is its position in added), and the rest
+  // are written; if value itself is rejected, nothing is written and
+  // SQLITE_CONSTRAINT is returned.
+  int UpdateWithDelta(Message* value, const FieldDescriptor *fd,
+                      const std::vector<int64_t>& added, const std::vector<int64_t>& removed,
+                      std::vector<RowError> *errors = NULL);
+
+  // Batch writes: BeginBatch opens a transaction, WriteBatchRow writes one row
+  // inside a savepoint (so a rejected row leaves nothing behind) and records a
+  // RowError on constraint failures, and CommitBatch commits, returning false
+  // (with the reason in error) if the commit itself was rejected and the
+  // transaction rolled back.
+  void BeginBatch();
+  bool WriteBatchRow(Message* value, Operation op, size_t index, std::vector<RowError> *errors);
+  bool CommitBatch(std::string *error);
+  void NotifyWritten(const Message& row);
+  int BindFromFields(const Message& object, const PreparedStatement& statement);
   bool ProtoFromRows(sqlite3_stmt *ps, Message *result);
+  bool ProtoFromRows(const PreparedStatement& statement, Message *result);
+
+  // Returns the cached statement for (op, table, mask), preparing it on
+  // first use.  mask has bit i set if desc_->field(i) participates in the
+  // statement; its meaning per operation is described in BuildQuery().
+  PreparedStatement* Statement(Operation op, const std::string& table, uint64_t mask);
+  uint64_t FieldMask(const Message& object, bool include_repeated) const;
+  // For rows that don't carry repeated int64 field as a column, load it with
+  // a second query: sql is run with the row's ID bound to ?1, and the first
+  // column of each result row is appended in order.  An empty sql removes
+  // the source.
+  void SetRepeatedSource(const std::string& field, const std::string& sql);
+  void LoadRepeatedSources(const PreparedStatement& statement, Message *result);
+
+  // Returns a cached statement for an arbitrary query whose result columns
+  // need not map onto the proto; callers read them with sqlite3_column_*.
+  PreparedStatement* Query(const std::string& sql);
 
   sqlite3 *db_;
  private:
+  std::string BuildQuery(Operation op, const std::string& table, uint64_t mask) const;
+  void PlanColumns(sqlite3_stmt *ps, std::vector<const FieldDescriptor *> *columns) const;
+
+  struct StatementKey {
+    StatementKey(Operation o, const std::string& t, uint64_t m) : op(o), table(t), mask(m) {}
+    bool operator<(const StatementKey& other) const {
+      if (op != other.op) return op < other.op;
+      if (mask != other.mask) return mask < other.mask;
+      return table < other.table;
+    }
+    Operation op;
+    std::string table;
+    uint64_t mask;
+  };
+  typedef std::map<StatementKey, PreparedStatement*> StatementCache;
+  typedef std::map<const FieldDescriptor *, std::string> RepeatedSources;
+
   const Descriptor *desc_;
   DynamicMessageFactory factory_;
-  sqlite3_stmt *lookup_by_id_;
+  StatementCache statements_;
+  RepeatedSources repeated_sources_;
+  const RowMapper *row_mapper_;
 
  protected:
   std::string table_;
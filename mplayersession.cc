@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include "playableitem.h"
 #include "mplayersession.h"
+#include "writebehind.h"
 #include "stdio.h"
 #include <string>
 #include <iostream>
@@ -55,7 +56,13 @@ MplayerSession::MplayerSession() :
 bool MplayerSession::Play(PlayableItem& item) {
   if  (item.data().has_playableitemid()) {
     item.IncrementPlaycount();
-    item.Update();
+    // Don't make the next track wait on the disk if we can help it.
+    WriteBehind *writer = WriteBehind::get();
+    if (writer) {
+      writer->IncrementPlaycount(item.data().playableitemid());
+    } else {
+      item.Update();
+    }
   }
   return Play(item.data());
 }
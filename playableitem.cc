@@ -41,6 +41,11 @@
 #include "playlist.pb.h"
 #include "playableitem.pb.h"
 #include "protostore.h"
+#include "durationprobe.h"
+#include <gflags/gflags.h>
+
+DEFINE_bool(probe_duration, true, "Read new items' durations from their headers where the format "
+  "allows, rather than having mplayer decode the whole file.");
 
 #define MAX(a,b) ((a>b)?a:b)
 
@@ -51,7 +56,7 @@ bool PlayableItem::fetch(const std::string& filename) {
   bool result = Load(&canonical_);
 
   if (canonical_.has_filename() && !canonical_.has_duration()) {
-    canonical_.set_duration(CalculateDuration());
+    canonical_.set_duration(MeasureDuration(canonical_.filename()));
   }
   
   return result;
@@ -88,29 +93,27 @@ bool PlayableItem::matches(const regex_t& re) {
 }
 #endif
 
-int PlayableItem::CalculateDuration() {
+int PlayableItem::MeasureDuration(const std::string& filename) {
   pid_t child;
   int pipefd[2];
-  std::string filename;
-  
-  if (!canonical_.has_filename()) {
-    LOG(INFO) << "Asked about duration but provided no filename";
-    return -1;
-  }
-  filename = canonical_.filename();
 
   struct stat statobj;
   if (stat(filename.c_str(), &statobj) || !statobj.st_size || !S_ISREG(statobj.st_mode)) {
     LOG(INFO) << "Asked about duration of an invalid file " << filename;
     return -1;
   }
+
+  double seconds;
+  if (FLAGS_probe_duration && ProbeDuration(filename, &seconds)) {
+    return ceil(seconds);
+  }
  
   CHECK(pipe2(pipefd, 0) == 0);
   char buf[1000];
   int duration;
   int errorfd = open("/dev/null", O_WRONLY);
   CHECK(errorfd != -1);
-  LOG(INFO) << "In CalculateDuration for " << filename;
+  LOG(INFO) << "In MeasureDuration for " << filename;
   duration = -1;
 
   child = fork();
@@ -123,6 +126,7 @@ int PlayableItem::CalculateDuration() {
     }
     close(STDIN_FILENO);
     execlp("mplayer", "", "-noconsolecontrols", "-ao", "pcm:file=/dev/null", filename.c_str(), NULL);
+    _exit(127);  // No mplayer; don't carry on as a copy of the caller.
 
   } else {
     FILE *mplayer_stdout;
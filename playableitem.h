@@ -43,9 +43,11 @@ class PlayableItem : public automation::ThreadSafeProto<automation::PlayableItem
   bool matches(const regex_t& pattern);
 #endif
   void IncrementPlaycount();
+  // The duration of filename in seconds, or -1 if it can't be played.
+  // Safe to call from any thread.
+  static int MeasureDuration(const std::string& filename);
   PlayableItem(sqlite3 *db);
  private:
-  int CalculateDuration();
   DISALLOW_COPY_AND_ASSIGN(PlayableItem);
 };
 
@@ -14,47 +14,149 @@
  *   limitations under the License.
  */
 #include <algorithm>
+#include <iterator>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <algorithm>
 #include <set>
 #include <sstream>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
 
+#include "alias.h"
 #include "automationstate.h"
+#include "catalog.h"
+#include "gapfill.h"
 #include "playableitem.h"
 #include "playlist.h"
 #include "playlist.pb.h"
 #include "protostore.h"
+#include "regexfilter.h"
+#include "shuffle.h"
+#include "writebehind.h"
 
 #include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 
 #define INT64_MAX LLONG_MAX
 
 using automation::ProtoStore;
 
-automation::Playlists Playlist::FetchAllLists(sqlite3 *db) {
-  automation::ProtoStore<automation::Playlist> pstore(db, "Playlists_with_size");
+// Members of a playlist, read straight from the join table with one row per
+// ID.  OrderMembersLocked then puts them in order.
+static const char kMembers[] =
+  "SELECT PlayableItemID FROM Playlist_PlayableItemID WHERE PlaylistID = ?1";
 
-  vector<automation::Playlist> playlists;
-  pstore.LoadAll(&playlists, INT64_MAX, 0);
+DEFINE_int32(filter_threads, 0, "Threads to spread a playlist filter across; 0 means one per core.");
 
-  automation::Playlists list;
+DEFINE_int32(weights_max_age, 600, "Seconds after which playlist weights are read again from the "
+             "database, to pick up changes made by other processes.");
+
+// Fewest items worth giving a filter thread of its own.
+static const size_t kMinFilterShare = 1024;
+
+namespace {
+
+// The playlists a mainshow can be chosen from (those with members and a
+// positive weight), with an alias table over their weights.  Rebuilt when
+// a playlist is written through MessageStore, or every --weights_max_age
+// seconds to notice writes from elsewhere.
+class WeightedPlaylists : public automation::WriteObserver {
+ public:
+  static WeightedPlaylists *get() {
+    static WeightedPlaylists instance;
+    return &instance;
+  }
+
+  // A PlaylistID, or -1 if there are no candidates.
+  sqlite3_int64 Choose(sqlite3 *db) {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (!loaded_at_ || time(NULL) - loaded_at_ > FLAGS_weights_max_age) {
+      Load(db);
+    }
+    if (table_.empty()) {
+      return -1;
+    }
+    return ids_[table_.Sample(std::rand() / (RAND_MAX + 1.0))];
+  }
+
+  void Invalidate() {
+    boost::mutex::scoped_lock lock(mutex_);
+    loaded_at_ = 0;
+  }
+
+  void RowWritten(const google::protobuf::Message& row) {
+    Invalidate();
+  }
+
+ private:
+  WeightedPlaylists() : loaded_at_(0) {
+    automation::MessageStore::SetWriteObserver(automation::Playlist::descriptor(), this);
+  }
+
+  void Load(sqlite3 *db) {
+    sqlite3_stmt *ps;
+    CHECK(SQLITE_OK == sqlite3_prepare_v2(db,
+        "SELECT PlaylistID, weight FROM Playlist WHERE weight > 0 "
+        "  AND PlaylistID IN (SELECT PlaylistID FROM Playlist_PlayableItemID)",
+        -1, &ps, NULL)) << sqlite3_errmsg(db);
+    std::vector<double> weights;
+    ids_.clear();
+    while (sqlite3_step(ps) == SQLITE_ROW) {
+      ids_.push_back(sqlite3_column_int64(ps, 0));
+      weights.push_back(sqlite3_column_double(ps, 1));
+    }
+    sqlite3_finalize(ps);
+    table_.Build(weights);
+    loaded_at_ = time(NULL);
+    VLOG(5) << "Choosing mainshows from " << ids_.size() << " weighted playlists";
+  }
 
-  for (vector<automation::Playlist>::iterator it = playlists.begin(); it != playlists.end(); ++it) {
-    automation::Playlist *next = list.add_item();
-    next->CopyFrom(*it);
+  boost::mutex mutex_;  // Guards everything below.
+  time_t loaded_at_;    // 0 when not loaded.
+  std::vector<sqlite3_int64> ids_;
+  AliasTable table_;
+};
+
+}  // namespace
+
+void Playlist::WeightsChanged() {
+  WeightedPlaylists::get()->Invalidate();
+}
+
+void Playlist::VisitAllLists(sqlite3 *db, ListVisitor visitor) {
+  automation::ProtoStore<automation::Playlist> pstore(db, "Playlists_with_size");
+  automation::ProtoStore<automation::Playlist>::Cursor cursor(&pstore, INT64_MAX, 0);
+  while (cursor.Next()) {
+    visitor(cursor.row());
   }
+}
+
+static void AddToLists(automation::Playlists *list, const automation::Playlist& item) {
+  list->add_item()->CopyFrom(item);
+}
+
+automation::Playlists Playlist::FetchAllLists(sqlite3 *db) {
+  automation::Playlists list;
+  VisitAllLists(db, boost::bind(&AddToLists, &list, _1));
   return list; 
 }
 
 Playlist::Playlist(sqlite3 *db) :
-  automation::ThreadSafeProto<automation::Playlist>(db) {
+  automation::ThreadSafeProto<automation::Playlist>(db),
+  live_(-1),
+  live_counted_for_(0),
+  persisted_id_(-1) {
 }
 void Playlist::LockByName(sqlite3 *db, const std::string &name) {
   LOG(INFO) << "Locking playlist " << name;
+  WriteBehind *writer = WriteBehind::get();
+  if (writer) {
+    writer->LockPlaylist(name);
+    return;
+  }
   automation::ThreadSafeProto<automation::PlaylistLock> lock(db);
   lock.mutable_data().set_name(name);
   try {
@@ -64,17 +166,60 @@ void Playlist::LockByName(sqlite3 *db, const std::string &name) {
   }
 }
 
+const sqlite3_int64 DurationIndex::kNever;
+
+void DurationIndex::Build(const std::vector<sqlite3_int64>& durations) {
+  size_ = durations.size();
+  for (leaves_ = 1; leaves_ < size_; leaves_ *= 2) {}
+  tree_.assign(2 * leaves_, kNever);
+  std::copy(durations.begin(), durations.end(), tree_.begin() + leaves_);
+  for (size_t i = leaves_ - 1; i > 0; --i) {
+    tree_[i] = std::min(tree_[2 * i], tree_[2 * i + 1]);
+  }
+}
+
+void DurationIndex::Clear() {
+  leaves_ = 0;
+  size_ = 0;
+  tree_.clear();
+}
+
+int DurationIndex::FindFirst(sqlite3_int64 limit) const {
+  if (!size_ || tree_[1] > limit) {
+    return -1;
+  }
+  size_t i = 1;
+  while (i < leaves_) {
+    i = (tree_[2 * i] <= limit) ? 2 * i : 2 * i + 1;
+  }
+  return i - leaves_;
+}
+
+void DurationIndex::Remove(int position) {
+  size_t i = leaves_ + position;
+  tree_[i] = kNever;
+  for (i /= 2; i > 0; i /= 2) {
+    tree_[i] = std::min(tree_[2 * i], tree_[2 * i + 1]);
+  }
+}
+
+void DurationIndex::Restore(int position, sqlite3_int64 duration) {
+  size_t i = leaves_ + position;
+  tree_[i] = duration;
+  for (i /= 2; i > 0; i /= 2) {
+    tree_[i] = std::min(tree_[2 * i], tree_[2 * i + 1]);
+  }
+}
+
 void Playlist::PopWithTimelimit(int seconds, PlayableItem *result) {
   boost::mutex::scoped_lock lock(mutex_);
-  RepeatedField<int64>* songlist = canonical_.mutable_playableitemid();
   LOG(INFO) << "In playlist " << canonical_.name() << " for " << seconds << " of time with up to "
             << size_locked() << " choices";
 
-  for (list_type::iterator it = songlist->begin(); it != songlist->end(); ++it) {
-    if (*it == 0) { continue; }
-    result->Fetch(*it);
-    if (result->data().playableitemid() && result->data().duration() <= seconds) {
-      *it = 0;
+  IndexDurationsLocked();
+  for (int position; (position = durations_.FindFirst(seconds)) >= 0; ) {
+    PopPositionLocked(position, result);
+    if (result->data().has_playableitemid()) {
       return;
     }
   }
@@ -82,15 +227,88 @@ void Playlist::PopWithTimelimit(int seconds, PlayableItem *result) {
   LOG(WARNING) << "No acceptable item found.";
   return;
 }
+
+void Playlist::PeekWithTimelimit(int seconds, PlayableItem *result) {
+  boost::mutex::scoped_lock lock(mutex_);
+  IndexDurationsLocked();
+  int position = durations_.FindFirst(seconds);
+  automation::PlayableItem item;
+  if (position >= 0 && Catalog::get()->Lookup(db_, canonical_.playableitemid(position), &item)) {
+    result->CopyFrom(item);
+  } else {
+    result->Clear();
+  }
+}
+
+void Playlist::PopToFill(int shortest, int target, int longest, PlayableItem *result) {
+  boost::mutex::scoped_lock lock(mutex_);
+  IndexDurationsLocked();
+  std::vector<sqlite3_int64> durations(durations_.size());
+  for (size_t i = 0; i < durations.size(); ++i) {
+    durations[i] = durations_.duration(i);
+  }
+  std::vector<int> chosen;
+  if (FillGap(durations, shortest, target, longest, &chosen)) {
+    PopPositionLocked(chosen.front(), result);
+  } else {
+    result->Clear();
+  }
+}
+
+// (Re)builds durations_.  That also has to happen if the members were
+// changed behind our back, through mutable_data().
+void Playlist::IndexDurationsLocked() {
+  const RepeatedField<int64>& songlist = canonical_.playableitemid();
+  if (durations_.size() == static_cast<size_t>(songlist.size())) {
+    return;
+  }
+  Catalog *catalog = Catalog::get();
+  std::vector<sqlite3_int64> durations(songlist.size(), DurationIndex::kNever);
+  for (int i = 0; i < songlist.size(); ++i) {
+    sqlite3_int64 duration;
+    if (songlist.Get(i) && catalog->Duration(db_, songlist.Get(i), &duration)) {
+      durations[i] = duration;
+    }
+  }
+  durations_.Build(durations);
+}
+
+// Takes the member at position out of the list and fills in result with it,
+// or clears result if it has since vanished from the library.
+void Playlist::PopPositionLocked(int position, PlayableItem *result) {
+  RepeatedField<int64>* songlist = canonical_.mutable_playableitemid();
+  automation::PlayableItem item;
+  durations_.Remove(position);
+  if (Catalog::get()->Lookup(db_, songlist->Get(position), &item)) {
+    result->CopyFrom(item);
+    songlist->Set(position, 0);
+    popped_.push_back(std::make_pair(position, item.playableitemid()));
+    popped_members_.insert(item.playableitemid());
+    if (live_ > 0) {
+      live_--;
+    }
+  } else {
+    result->Clear();
+  }
+}
 void Playlist::PopFront(PlayableItem *result) {
   boost::mutex::scoped_lock lock(mutex_);
   RepeatedField<int64>* songlist = canonical_.mutable_playableitemid();
-  PlayableItem item(db_);
-
-  for (list_type::iterator it = songlist->begin(); it != songlist->end(); ++it) {
-    if (*it == 0) { continue; }
-    result->Fetch(*it);
-    *it = 0;
+  automation::PlayableItem item;
+
+  for (int i = 0; i < songlist->size(); ++i) {
+    if (songlist->Get(i) == 0) { continue; }
+    Catalog::get()->Lookup(db_, songlist->Get(i), &item);
+    result->CopyFrom(item);
+    popped_.push_back(std::make_pair(i, songlist->Get(i)));
+    popped_members_.insert(songlist->Get(i));
+    songlist->Set(i, 0);
+    if (durations_.size()) {
+      durations_.Remove(i);
+    }
+    if (live_ > 0) {
+      live_--;
+    }
     return;
   }
   result->Clear();
@@ -105,103 +323,375 @@ void Playlist::ApplyMergeRequest(const automation::PlaylistMergeRequest& request
   if (replace) {
     canonical_.clear_items();
     canonical_.clear_playableitemid();
+    popped_members_.clear();
   }
   canonical_.MergeFrom(merger);
+  ForgetIndex();
+}
+
+// Appends the items among ids[begin, end) that filter matches to found.
+static void FilterRange(sqlite3 *db, const RegexFilter *filter, const std::vector<sqlite3_int64> *ids,
+                        size_t begin, size_t end, std::vector<automation::PlayableItem> *found) {
+  Catalog *catalog = Catalog::get();
+  automation::PlayableItem item;
+  for (size_t i = begin; i < end; ++i) {
+    if (catalog->Lookup(db, (*ids)[i], &item) &&
+        (filter->Matches(item.description()) || filter->Matches(item.filename()))) {
+      found->push_back(item);
+    }
+  }
+}
+
+// FilterRange with a RegexFilter of its own, for a worker thread.
+static void FilterRangeWith(sqlite3 *db, const std::string *pattern, const std::vector<sqlite3_int64> *ids,
+                            size_t begin, size_t end, std::vector<automation::PlayableItem> *found) {
+  RegexFilter filter(*pattern);
+  FilterRange(db, &filter, ids, begin, end, found);
 }
 
 automation::Playlist Playlist::Filter(const std::string& regexp) const {
   automation::Playlist result;
+  RegexFilter filter(regexp);
+  if (!filter.ok()) {
+    return result;
+  }
 
-#ifdef USE_RE2
-  RE2 re("(?i)"+regexp);
+  // Work on a copy of the list, so that nobody waits on us to pop or add.
+  std::vector<sqlite3_int64> ids;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    ids.assign(canonical_.playableitemid().begin(), canonical_.playableitemid().end());
+  }
 
-  if (!re.ok()) {
-    return result;
+  // Each thread takes a contiguous share, so that putting their results
+  // back together in turn keeps the list's order, and compiles the
+  // expression for itself (see RegexFilter).
+  size_t threads = FLAGS_filter_threads > 0 ? FLAGS_filter_threads : boost::thread::hardware_concurrency();
+  threads = std::max<size_t>(1, std::min(threads, ids.size() / kMinFilterShare));
+  std::vector<std::vector<automation::PlayableItem> > found(threads);
+  boost::thread_group workers;
+  for (size_t t = 1; t < threads; ++t) {
+    workers.create_thread(boost::bind(&FilterRangeWith, db_, &regexp, &ids,
+                                      ids.size() * t / threads, ids.size() * (t + 1) / threads, &found[t]));
   }
-#else
-  regex_t re;
-  if (regcomp(&re, regexp.c_str(), REG_ICASE | REG_EXTENDED | REG_NOSUB)) {
-    return result;
+  FilterRange(db_, &filter, &ids, 0, ids.size() / threads, &found[0]);
+  workers.join_all();
+
+  for (size_t t = 0; t < threads; ++t) {
+    for (std::vector<automation::PlayableItem>::iterator it = found[t].begin(); it != found[t].end(); ++it) {
+      result.add_playableitemid(it->playableitemid());
+      result.add_items()->Swap(&*it);
+    }
   }
-#endif
+  return result;
+}
+
+automation::Playlist Playlist::Items() const {
+  automation::Playlist result;
+  automation::PlayableItem item;
+  Catalog *catalog = Catalog::get();
 
   boost::mutex::scoped_lock lock(mutex_);
   const RepeatedField<int64>& songlist = canonical_.playableitemid();
-  PlayableItem item(db_);
-
   for (list_type::const_iterator it = songlist.begin(); it != songlist.end(); ++it) {
-    item.Fetch(*it);
-    if (item.matches(re)) {
-      automation::PlayableItem *newitem = result.add_items();
-      newitem->CopyFrom(item.data());
-      result.add_playableitemid(newitem->playableitemid());
+    if (catalog->Lookup(db_, *it, &item)) {
+      result.add_items()->CopyFrom(item);
+      result.add_playableitemid(*it);
     }
   }
   return result;
 }
 
+// An FTS5 query for the words in query: each is quoted, so that nothing the
+// user types is taken as FTS syntax, and a trailing '*' is kept outside the
+// quotes to make it a prefix match.
+static std::string SearchExpression(const std::string& query) {
+  std::istringstream words(query);
+  std::string word, expression;
+  while (words >> word) {
+    bool prefix = word[word.size() - 1] == '*';
+    std::string quoted;
+    for (std::string::const_iterator it = word.begin(); it != word.end(); ++it) {
+      if (*it != '"' && *it != '*') {
+        quoted += *it;
+      }
+    }
+    if (quoted.empty()) {
+      continue;
+    }
+    expression += (expression.empty() ? "\"" : " \"") + quoted + (prefix ? "\"*" : "\"");
+  }
+  return expression;
+}
+
+bool Playlist::FetchSearch(const std::string& query, long long limit, long long offset) {
+  boost::mutex::scoped_lock lock(mutex_);
+  canonical_.Clear();
+  ForgetIndex();
+  canonical_.set_playlistid(0);
+  canonical_.set_name("SEARCH: " + query);
+  canonical_.set_weight(0);
+  RememberMembers(false);
+
+  std::string expression = SearchExpression(query);
+  if (expression.empty()) {
+    return false;
+  }
+  sqlite3_stmt *ps = Query(
+      "SELECT PlayableItemSearch.rowid FROM PlayableItemSearch "
+      "  JOIN PlayableItem ON PlayableItem.PlayableItemID = PlayableItemSearch.rowid "
+      "  WHERE PlayableItemSearch MATCH ?1 ORDER BY rank LIMIT ?2 OFFSET ?3")->ps;
+  sqlite3_bind_text(ps, 1, expression.data(), expression.size(), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(ps, 2, limit);
+  sqlite3_bind_int64(ps, 3, offset);
+  int rc;
+  while ((rc = sqlite3_step(ps)) == SQLITE_ROW) {
+    canonical_.add_playableitemid(sqlite3_column_int64(ps, 0));
+  }
+  if (rc != SQLITE_DONE) {
+    LOG(WARNING) << "Search for " << expression << " failed: " << sqlite3_errmsg(db_);
+  }
+  sqlite3_reset(ps);
+  return rc == SQLITE_DONE;
+}
+
 bool Playlist::Fetch() {
-  SetTable("Playlists_random_weight");
+  sqlite3_int64 playlistID = WeightedPlaylists::get()->Choose(db_);
   boost::mutex::scoped_lock lock(mutex_);
 
   canonical_.Clear();
-  bool result = Load(&canonical_);
-  SetTable("Playlists");
+  ForgetIndex();
+  bool result = false;
+  if (playlistID >= 0) {
+    SetTable("Playlist");
+    SetRepeatedSource("PlayableItemID", kMembers);
+    result = LoadById(&canonical_, playlistID);
+    SetRepeatedSource("PlayableItemID", "");
+    SetTable("Playlists");
+  }
+  if (result) {
+    OrderMembersLocked(LEAST_PLAYED_FIRST);
+  }
+  RememberMembers(result);
   return result;
 } 
 
 bool Playlist::Fetch(const std::string& playlistname) {
-  SetTable("Playlists_with_children");
+  SetTable("Playlist");
+  SetRepeatedSource("PlayableItemID", kMembers);
 
   boost::mutex::scoped_lock lock(mutex_);
   canonical_.Clear();
+  ForgetIndex();
   canonical_.set_name(playlistname);
   bool result = Load(&canonical_);
+  if (result) {
+    OrderMembersLocked(LONGEST_FIRST);
+  }
+  RememberMembers(result);
+  SetRepeatedSource("PlayableItemID", "");
   SetTable("Playlists");
   return result;
 }
 bool Playlist::FetchShuffled(const std::string& playlistname) {
-  SetTable("Playlists_with_shuffled_children");
+  SetTable("Playlist");
+  SetRepeatedSource("PlayableItemID", kMembers);
 
   boost::mutex::scoped_lock lock(mutex_);
   canonical_.Clear();
+  ForgetIndex();
   canonical_.set_name(playlistname);
   bool result = Load(&canonical_);
+  if (result) {
+    OrderMembersLocked(LEAST_PLAYED_FIRST);
+  }
+  RememberMembers(result);
+  SetRepeatedSource("PlayableItemID", "");
   SetTable("Playlists");
   return result;
 }
 bool Playlist::FetchSuperlist(long long limit, long long offset) {
-  char buf[1024];
-
-  snprintf(buf, sizeof buf, "CREATE TEMPORARY VIEW Playlists_with_everything AS "
-" SELECT 0 AS PlaylistID, 'ALL TRACKS' AS name, 0 as weight, "
-"        group_concat(PlayableItemID) AS PlayableItemID "
-"        FROM (SELECT PlayableItemID FROM PlayableItem ORDER BY duration DESC LIMIT %lld OFFSET %lld) group by 1;", limit, offset);
-
-  
-  CHECK(sqlite3_exec(db_, buf, NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
+  boost::mutex::scoped_lock lock(mutex_);
+  canonical_.Clear();
+  ForgetIndex();
+  canonical_.set_playlistid(0);
+  canonical_.set_name("ALL TRACKS");
+  canonical_.set_weight(0);
+  RememberMembers(false);
+  next_page_token_.clear();
+
+  // Read straight off durationdex, longest first.
+  sqlite3_stmt *ps = Query("SELECT PlayableItemID FROM PlayableItem "
+                           "ORDER BY duration DESC, PlayableItemID DESC LIMIT ?1 OFFSET ?2")->ps;
+  sqlite3_bind_int64(ps, 1, limit);
+  sqlite3_bind_int64(ps, 2, offset);
+  while (sqlite3_step(ps) == SQLITE_ROW) {
+    canonical_.add_playableitemid(sqlite3_column_int64(ps, 0));
+  }
+  sqlite3_reset(ps);
+  return canonical_.playableitemid_size() > 0;
+}
 
-  SetTable("Playlists_with_everything");
+bool Playlist::FetchSuperlistPage(long long limit, const std::string& token) {
+  automation::PageToken position;
+  if (!automation::DecodePageToken(token, &position)) {
+    LOG(WARNING) << "Ignoring malformed page token " << token;
+    return false;
+  }
 
   boost::mutex::scoped_lock lock(mutex_);
   canonical_.Clear();
-  bool result = LoadById(&canonical_, 0);
-  CHECK(sqlite3_exec(db_, "DROP VIEW Playlists_with_everything", NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
+  ForgetIndex();
+  canonical_.set_playlistid(0);
+  canonical_.set_name("ALL TRACKS");
+  canonical_.set_weight(0);
+  RememberMembers(false);
+
+  // Seek past the last (duration, PlayableItemID) we handed out instead of
+  // using OFFSET, which has to walk every row before the page.
+  sqlite3_stmt *ps;
+  if (position.has_id()) {
+    ps = Query("SELECT PlayableItemID, duration FROM PlayableItem "
+               "WHERE duration < ?1 OR (duration = ?1 AND PlayableItemID < ?2) "
+               "ORDER BY duration DESC, PlayableItemID DESC LIMIT ?3")->ps;
+    sqlite3_bind_int64(ps, 1, position.duration());
+    sqlite3_bind_int64(ps, 2, position.id());
+  } else {
+    ps = Query("SELECT PlayableItemID, duration FROM PlayableItem "
+               "ORDER BY duration DESC, PlayableItemID DESC LIMIT ?3")->ps;
+  }
+  sqlite3_bind_int64(ps, 3, limit);
+
+  long long count = 0;
+  while (sqlite3_step(ps) == SQLITE_ROW) {
+    position.set_id(sqlite3_column_int64(ps, 0));
+    position.set_duration(sqlite3_column_int64(ps, 1));
+    canonical_.add_playableitemid(position.id());
+    count++;
+  }
+  sqlite3_reset(ps);
 
-  SetTable("Playlists");
-  return result;
+  next_page_token_ = (count == limit) ? automation::EncodePageToken(position) : "";
+  return true;
+}
+std::string Playlist::next_page_token() const {
+  boost::mutex::scoped_lock lock(mutex_);
+  return next_page_token_;
 }
 
 bool Playlist::Fetch(int playlistID) {
   boost::mutex::scoped_lock lock(mutex_);
   canonical_.Clear();
-  SetTable("Playlists_with_children");
+  ForgetIndex();
+  SetTable("Playlist");
+  SetRepeatedSource("PlayableItemID", kMembers);
 
   bool result = LoadById(&canonical_, playlistID);
+  if (result) {
+    OrderMembersLocked(LONGEST_FIRST);
+  }
+  RememberMembers(result);
+  SetRepeatedSource("PlayableItemID", "");
   SetTable("Playlists");
   return result;
 }
 
+// Shuffles the members within runs of equal duration or playcount, leaving
+// out any that are no longer in the library.
+void Playlist::OrderMembersLocked(MemberOrder order) {
+  RepeatedField<int64>* songlist = canonical_.mutable_playableitemid();
+  Catalog *catalog = Catalog::get();
+  std::vector<KeyedMember> members;
+  members.reserve(songlist->size());
+  for (list_type::const_iterator it = songlist->begin(); it != songlist->end(); ++it) {
+    sqlite3_int64 duration;
+    int playcount;
+    if (order == LONGEST_FIRST && catalog->Duration(db_, *it, &duration)) {
+      members.push_back(KeyedMember(-duration, *it));
+    } else if (order == LEAST_PLAYED_FIRST && catalog->Playcount(db_, *it, &playcount)) {
+      members.push_back(KeyedMember(playcount, *it));
+    }
+  }
+  ShuffleByKey(&members);
+  songlist->Clear();
+  for (std::vector<KeyedMember>::const_iterator it = members.begin(); it != members.end(); ++it) {
+    songlist->Add(it->second);
+  }
+}
+
+// The distinct IDs in songlist, sorted.  Slots zeroed by PopFront and
+// friends are left out; Replace adds those members back from
+// popped_members_.
+static void SortedMembers(const RepeatedField<int64>& songlist, std::vector<int64_t> *members) {
+  members->clear();
+  for (RepeatedField<int64>::const_iterator it = songlist.begin(); it != songlist.end(); ++it) {
+    if (*it) {
+      members->push_back(*it);
+    }
+  }
+  std::sort(members->begin(), members->end());
+  members->erase(std::unique(members->begin(), members->end()), members->end());
+}
+
+// Records the members as they now stand in the database, so that Replace
+// can write only what changed.  If loaded is false the list has no stored
+// counterpart and the next Replace writes it in full.
+void Playlist::RememberMembers(bool loaded) {
+  popped_members_.clear();
+  if (!loaded) {
+    persisted_id_ = -1;
+    persisted_members_.clear();
+    return;
+  }
+  persisted_id_ = canonical_.playlistid();
+  SortedMembers(canonical_.playableitemid(), &persisted_members_);
+}
+
+int Playlist::Replace(std::vector<automation::RowError> *errors) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (errors && !canonical_.has_playlistid()) {
+    // A new playlist: store it empty, so that its members go through the
+    // delta below and can be rejected one at a time.
+    automation::Playlist empty(canonical_);
+    empty.clear_playableitemid();
+    ProtoStore<automation::Playlist>::Replace(&empty);
+    canonical_.set_playlistid(empty.playlistid());
+    persisted_id_ = empty.playlistid();
+    persisted_members_.clear();
+    popped_members_.clear();
+  }
+  if (!canonical_.has_playlistid() || canonical_.playlistid() != persisted_id_) {
+    int result = ProtoStore<automation::Playlist>::Replace(&canonical_);
+    RememberMembers(true);
+    return result;
+  }
+
+  std::vector<int64_t> current, listed;
+  SortedMembers(canonical_.playableitemid(), &listed);
+  std::set_union(listed.begin(), listed.end(), popped_members_.begin(), popped_members_.end(),
+                 std::back_inserter(current));
+
+  std::vector<int64_t> added, removed;
+  std::set_difference(current.begin(), current.end(), persisted_members_.begin(), persisted_members_.end(),
+                      std::back_inserter(added));
+  std::set_difference(persisted_members_.begin(), persisted_members_.end(), current.begin(), current.end(),
+                      std::back_inserter(removed));
+  size_t first_error = errors ? errors->size() : 0;
+  int result = UpdateWithDelta(&canonical_, canonical_.GetDescriptor()->FindFieldByName("PlayableItemID"),
+                               added, removed, errors);
+  if (result == SQLITE_CONSTRAINT) {
+    return result;  // Nothing was written.
+  }
+  for (size_t i = first_error; errors && i < errors->size(); ++i) {
+    int64_t rejected = added[(*errors)[i].index];
+    current.erase(std::lower_bound(current.begin(), current.end(), rejected));
+    const list_type& members = canonical_.playableitemid();
+    (*errors)[i].index = std::find(members.begin(), members.end(), rejected) - members.begin();
+  }
+  persisted_members_.swap(current);
+  return result;
+}
+
 int Playlist::Size() const {
   boost::mutex::scoped_lock lock(mutex_);
   return size_locked();
@@ -212,12 +702,49 @@ std::string Playlist::Name() const {
 }
 int Playlist::size_locked() const {
   const RepeatedField<int64>& songlist = canonical_.playableitemid();
+  if (live_ >= 0 && live_counted_for_ == songlist.size()) {
+    return live_;
+  }
   int size = 0;
   for (list_type::const_iterator it = songlist.begin(); it != songlist.end(); ++it) {
     if (*it) {
       size++;
     } 
   } 
+  live_ = size;
+  live_counted_for_ = songlist.size();
   return size;
 }
 
+// Called whenever the members are replaced wholesale.
+void Playlist::ForgetIndex() {
+  live_ = -1;
+  durations_.Clear();
+  popped_.clear();
+}
+
+int Playlist::Restore() {
+  boost::mutex::scoped_lock lock(mutex_);
+  RepeatedField<int64>* songlist = canonical_.mutable_playableitemid();
+  Catalog *catalog = Catalog::get();
+  int restored = 0;
+  for (std::vector<std::pair<int, sqlite3_int64> >::iterator it = popped_.begin(); it != popped_.end(); ++it) {
+    // Skip anything that isn't as we left it (mutable_data() again).
+    if (it->first >= songlist->size() || songlist->Get(it->first) != 0) {
+      continue;
+    }
+    songlist->Set(it->first, it->second);
+    restored++;
+    sqlite3_int64 duration;
+    if (durations_.size() == static_cast<size_t>(songlist->size()) &&
+        catalog->Duration(db_, it->second, &duration)) {
+      durations_.Restore(it->first, duration);
+    }
+    if (live_ >= 0) {
+      live_++;
+    }
+  }
+  popped_.clear();
+  return restored;
+}
+
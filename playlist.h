@@ -16,7 +16,11 @@
 #ifndef PLAYLIST_H
 #define PLAYLIST_H
 
+#include <limits.h>
+#include <set>
 #include <string>
+#include <vector>
+#include <boost/function.hpp>
 #include "sqlite3.h"
 #include "base.h"
 #include "playableitem.h"
@@ -26,14 +30,57 @@
 
 class Playlist;
 
+// The durations of a list's entries by position, kept as a tree of minimums
+// so that the first remaining entry no longer than some limit can be found,
+// and an entry removed, in O(log n).
+class DurationIndex {
+ public:
+  // Duration of an entry that can never be chosen.
+  static const sqlite3_int64 kNever = LLONG_MAX;
+
+  DurationIndex() : leaves_(0), size_(0) {}
+  void Build(const std::vector<sqlite3_int64>& durations);
+  void Clear();
+  // Number of positions indexed; 0 before Build.
+  size_t size() const { return size_; }
+  sqlite3_int64 duration(int position) const { return tree_[leaves_ + position]; }
+  // The first position whose duration is at most limit, or -1.
+  int FindFirst(sqlite3_int64 limit) const;
+  void Remove(int position);
+  void Restore(int position, sqlite3_int64 duration);
+
+ private:
+  size_t leaves_;
+  size_t size_;
+  std::vector<sqlite3_int64> tree_;  // tree_[1] is the root, leaves from leaves_.
+};
+
 typedef boost::shared_ptr<Playlist> PlaylistPtr;
 
 class Playlist : public automation::ThreadSafeProto<automation::Playlist> {
  public:
   static void LockByName(sqlite3 *db, const std::string &target);
   static automation::Playlists FetchAllLists(sqlite3 *db);
+  // Calls visitor with each persisted playlist (and its length) in turn,
+  // holding only one of them in memory at a time.
+  typedef boost::function<void(const automation::Playlist&)> ListVisitor;
+  static void VisitAllLists(sqlite3 *db, ListVisitor visitor);
+  // Tells Fetch() that weights or members may have changed other than
+  // through MessageStore.
+  static void WeightsChanged();
   void PopWithTimelimit(int seconds, PlayableItem *target); 
   void PopFront(PlayableItem *target);
+  // Pops the first of the fewest members that together last between
+  // shortest and longest seconds (as near to target as possible), so that
+  // playing the rest of them afterwards fills the time.  Clears result if
+  // there are none.
+  void PopToFill(int shortest, int target, int longest, PlayableItem *result);
+  // Puts every member popped since the list was loaded (or last restored)
+  // back where it was, returning how many there were.  Costs as much as
+  // the number of pops, not the length of the list.
+  int Restore();
+  // The member PopWithTimelimit would pop right now, without popping it.
+  void PeekWithTimelimit(int seconds, PlayableItem *result);
 
   int Size() const;
   std::string Name() const;
@@ -42,17 +89,63 @@ class Playlist : public automation::ThreadSafeProto<automation::Playlist> {
   int get_weight() const;
 
   automation::Playlist Filter(const std::string& pattern) const;
+  // The members along with their PlayableItems, as Filter returns them.
+  automation::Playlist Items() const;
+  // Picks a playlist at random, by weight, and loads it least played first.
   bool Fetch();
   bool FetchShuffled(const std::string& playlistname);
   bool Fetch(const std::string& playlistname);
   bool FetchSuperlist(long long limit, long long offset);
+  // Keyset-paginated FetchSuperlist: loads up to limit items, longest first,
+  // following the position in token (empty for the first page).  The token
+  // for the following page is then available from next_page_token().
+  bool FetchSuperlistPage(long long limit, const std::string& token);
+  std::string next_page_token() const;
   bool Fetch(int playlistID);
+  // Loads the library items matching query from the search index, best
+  // match first.  The query is a list of words, all of which must appear
+  // in the filename or description; a word ending in '*' matches any word
+  // it begins.
+  bool FetchSearch(const std::string& query, long long limit, long long offset);
+  // Saves the playlist.  When it was fetched from (or last saved as) the
+  // same stored playlist, only the members added or removed since then are
+  // written; otherwise every member is.  Without errors, a member the
+  // database rejects (one not in the library) throws ConstraintException;
+  // with them, it is reported there (index is its position in the
+  // playlist), and the playlist is saved without it.
+  int Replace(std::vector<automation::RowError> *errors = NULL);
 
   Playlist(sqlite3 *db);
  private:
   bool CompareDurations(sqlite3_int64 item1, sqlite3_int64 item2, PlayableItem* fetcher);
   typedef google::protobuf::RepeatedField< ::google::protobuf::int64> list_type;
   int size_locked() const;
+  void RememberMembers(bool loaded);
+  void ForgetIndex();
+  enum MemberOrder { LONGEST_FIRST, LEAST_PLAYED_FIRST };
+  void OrderMembersLocked(MemberOrder order);
+  void IndexDurationsLocked();
+  void PopPositionLocked(int position, PlayableItem *result);
+
+  // Members left in the list and their index by duration, for
+  // PopWithTimelimit.  Both are worked out when first needed after the
+  // members change; live_ is -1 until then.
+  mutable int live_;
+  mutable int live_counted_for_;  // playableitemid_size() when live_ was counted.
+  DurationIndex durations_;
+  // (position, PlayableItemID) of each member popped since the members
+  // were last replaced or restored.
+  std::vector<std::pair<int, sqlite3_int64> > popped_;
+  // Members popped since they were last read or written.  Popping only
+  // takes a member out of rotation here, so Replace still counts these as
+  // members of the stored list.
+  std::set<int64_t> popped_members_;
+
+  std::string next_page_token_;
+  // PlaylistID and sorted members as last read from or written to the
+  // database; persisted_id_ is -1 when there is no such copy.
+  sqlite3_int64 persisted_id_;
+  std::vector<int64_t> persisted_members_;
 
   DISALLOW_COPY_AND_ASSIGN(Playlist);
 };
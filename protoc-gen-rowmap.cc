@@ -0,0 +1,271 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+// A protoc plugin that writes foo.rowmap.h for foo.proto: for each message,
+// a RowMapper (see messagestore.h) that binds and reads its columns with the
+// generated accessors instead of reflection, and the RowMapperFor
+// specialization that hands it to ProtoStore.  Run as
+//
+//   protoc foo.proto --plugin=protoc-gen-rowmap=./protoc-gen-rowmap --rowmap_out=.
+//
+// The same field types MessageStore's reflection path handles are mapped:
+// int32, int64 and string/bytes columns, and group_concat lists of IDs for
+// repeated int64.  Any other field gets the same CHECK failure it would get
+// from reflection if it ever turned up in a statement.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <boost/scoped_ptr.hpp>
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+using namespace google::protobuf;
+using google::protobuf::compiler::GeneratorContext;
+
+typedef std::map<std::string, std::string> Variables;
+
+class RowMapGenerator : public compiler::CodeGenerator {
+ public:
+  bool Generate(const FileDescriptor* file, const std::string& parameter,
+                GeneratorContext* context, std::string* error) const;
+
+ private:
+  void GenerateMapper(const Descriptor* message, io::Printer* printer) const;
+  void GenerateBind(const Descriptor* message, io::Printer* printer) const;
+  void GenerateRead(const Descriptor* message, io::Printer* printer) const;
+};
+
+static std::string StripProto(const std::string& filename) {
+  size_t dot = filename.rfind(".proto");
+  return dot == std::string::npos ? filename : filename.substr(0, dot);
+}
+
+// The generated accessor name for a field; protoc lowercases it.
+static std::string Accessor(const FieldDescriptor* field) {
+  std::string name = field->name();
+  for (std::string::iterator it = name.begin(); it != name.end(); ++it) {
+    *it = tolower(*it);
+  }
+  return name;
+}
+
+// The C++ name of a message, e.g. automation::PlayableItem.  (Not
+// ::automation::..., since "<::" reads as a digraph to older compilers.)
+static std::string ClassName(const Descriptor* message) {
+  std::string name = message->full_name();
+  for (size_t pos = name.find('.'); pos != std::string::npos; pos = name.find('.', pos)) {
+    name.replace(pos, 1, "::");
+  }
+  return name;
+}
+
+static bool IsString(const FieldDescriptor* field) {
+  return field->type() == FieldDescriptor::TYPE_STRING || field->type() == FieldDescriptor::TYPE_BYTES;
+}
+
+bool RowMapGenerator::Generate(const FileDescriptor* file, const std::string& parameter,
+                               GeneratorContext* context, std::string* error) const {
+  std::string basename = StripProto(file->name());
+  std::string guard = basename + "_ROWMAP_H";
+  for (std::string::iterator it = guard.begin(); it != guard.end(); ++it) {
+    *it = isalnum(*it) ? toupper(*it) : '_';
+  }
+
+  boost::scoped_ptr<io::ZeroCopyOutputStream> output(context->Open(basename + ".rowmap.h"));
+  io::Printer printer(output.get(), '$');
+  Variables vars;
+  vars["file"] = file->name();
+  vars["basename"] = basename;
+  vars["guard"] = guard;
+  printer.Print(vars,
+    "// Generated by protoc-gen-rowmap from $file$.  DO NOT EDIT.\n"
+    "#ifndef $guard$\n"
+    "#define $guard$\n"
+    "\n"
+    "#include <glog/logging.h>\n"
+    "#include \"sqlite3.h\"\n"
+    "#include \"messagestore.h\"\n"
+    "#include \"$basename$.pb.h\"\n"
+    "\n"
+    "namespace automation {\n");
+
+  for (int i = 0; i < file->message_type_count(); ++i) {
+    GenerateMapper(file->message_type(i), &printer);
+  }
+
+  printer.Print(vars,
+    "\n"
+    "}  // namespace automation\n"
+    "\n"
+    "#endif  // $guard$\n");
+  if (printer.failed()) {
+    *error = "Unable to write " + basename + ".rowmap.h";
+    return false;
+  }
+  return true;
+}
+
+void RowMapGenerator::GenerateMapper(const Descriptor* message, io::Printer* printer) const {
+  Variables vars;
+  vars["name"] = message->name();
+  vars["class"] = ClassName(message);
+  std::string columns;
+  for (int i = 0; i < message->field_count(); ++i) {
+    columns += (i ? ", \"" : "\"") + message->field(i)->name() + "\"";
+  }
+  vars["columns"] = columns.empty() ? "NULL" : columns;
+  char count[16];
+  snprintf(count, sizeof count, "%d", message->field_count());
+  vars["count"] = count;
+
+  printer->Print(vars,
+    "\n"
+    "class $name$RowMapper : public RowMapper {\n"
+    " public:\n"
+    "  static const int kColumnCount = $count$;\n"
+    "  static const char* const* Columns() {\n"
+    "    static const char* const kColumns[] = { $columns$ };\n"
+    "    return kColumns;\n"
+    "  }\n"
+    "  int column_count() const { return kColumnCount; }\n"
+    "  const char* const* columns() const { return Columns(); }\n"
+    "\n");
+  printer->Indent();
+  GenerateBind(message, printer);
+  GenerateRead(message, printer);
+  printer->Outdent();
+  printer->Print(vars,
+    "};\n"
+    "\n"
+    "template<> struct RowMapperFor<$class$> {\n"
+    "  static const RowMapper* Get() {\n"
+    "    static const $name$RowMapper mapper;\n"
+    "    return &mapper;\n"
+    "  }\n"
+    "};\n");
+}
+
+void RowMapGenerator::GenerateBind(const Descriptor* message, io::Printer* printer) const {
+  Variables vars;
+  vars["class"] = ClassName(message);
+  printer->Print(vars,
+    "int Bind(const google::protobuf::Message& object, const PreparedStatement& statement) const {\n"
+    "  const $class$& m = static_cast<const $class$&>(object);\n"
+    "  (void) m;  // Unused if every field is repeated.\n"
+    "  int i = 1;\n"
+    "  for (std::vector<const google::protobuf::FieldDescriptor *>::const_iterator it = statement.params.begin();\n"
+    "       it != statement.params.end(); ++it, ++i) {\n"
+    "    switch ((*it)->number()) {\n");
+  printer->Indent();
+  printer->Indent();
+  printer->Indent();
+  for (int i = 0; i < message->field_count(); ++i) {
+    const FieldDescriptor* field = message->field(i);
+    if (field->is_repeated()) {
+      continue; // Never a parameter; repeated fields live in join tables.
+    }
+    char number[16];
+    snprintf(number, sizeof number, "%d", field->number());
+    vars["number"] = number;
+    vars["field"] = Accessor(field);
+    if (field->type() == FieldDescriptor::TYPE_INT32) {
+      printer->Print(vars, "case $number$: sqlite3_bind_int(statement.ps, i, m.$field$()); break;\n");
+    } else if (field->type() == FieldDescriptor::TYPE_INT64) {
+      printer->Print(vars, "case $number$: sqlite3_bind_int64(statement.ps, i, m.$field$()); break;\n");
+    } else if (IsString(field)) {
+      printer->Print(vars,
+        "case $number$:\n"
+        "  sqlite3_bind_text(statement.ps, i, m.$field$().data(), m.$field$().size(), SQLITE_TRANSIENT);\n"
+        "  break;\n");
+    }
+  }
+  printer->Print(
+    "default:\n"
+    "  CHECK(false) << \"Unsupported \" << (*it)->type();\n");
+  printer->Outdent();
+  printer->Outdent();
+  printer->Outdent();
+  printer->Print(
+    "    }\n"
+    "  }\n"
+    "  return i;\n"
+    "}\n");
+}
+
+void RowMapGenerator::GenerateRead(const Descriptor* message, io::Printer* printer) const {
+  Variables vars;
+  vars["class"] = ClassName(message);
+  printer->Print(vars,
+    "void Read(const PreparedStatement& statement, google::protobuf::Message* result) const {\n"
+    "  $class$* m = static_cast<$class$*>(result);\n"
+    "  sqlite3_stmt *ps = statement.ps;\n"
+    "  (void) m;  // Unused if no field can be read.\n"
+    "  (void) ps;\n"
+    "  for (size_t i = 0; i < statement.columns.size(); ++i) {\n"
+    "    switch (statement.columns[i]->number()) {\n");
+  printer->Indent();
+  printer->Indent();
+  printer->Indent();
+  for (int i = 0; i < message->field_count(); ++i) {
+    const FieldDescriptor* field = message->field(i);
+    char number[16];
+    snprintf(number, sizeof number, "%d", field->number());
+    vars["number"] = number;
+    vars["field"] = Accessor(field);
+    if (field->is_repeated()) {
+      if (field->type() == FieldDescriptor::TYPE_INT64) {
+        printer->Print(vars,
+          "case $number$: {\n"
+          "  const char *text = (const char *) sqlite3_column_text(ps, i);\n"
+          "  int64_t id;\n"
+          "  while (NextListedId(&text, &id)) {\n"
+          "    m->add_$field$(id);\n"
+          "  }\n"
+          "  break;\n"
+          "}\n");
+      }
+    } else if (field->type() == FieldDescriptor::TYPE_INT32) {
+      printer->Print(vars, "case $number$: m->set_$field$(sqlite3_column_int(ps, i)); break;\n");
+    } else if (field->type() == FieldDescriptor::TYPE_INT64) {
+      printer->Print(vars, "case $number$: m->set_$field$(sqlite3_column_int64(ps, i)); break;\n");
+    } else if (IsString(field)) {
+      printer->Print(vars,
+        "case $number$:\n"
+        "  m->set_$field$((const char *) sqlite3_column_blob(ps, i), sqlite3_column_bytes(ps, i));\n"
+        "  break;\n");
+    }
+  }
+  printer->Print(
+    "default:\n"
+    "  CHECK(false) << \"Unknown type \" << statement.columns[i]->type();\n");
+  printer->Outdent();
+  printer->Outdent();
+  printer->Outdent();
+  printer->Print(
+    "    }\n"
+    "  }\n"
+    "}\n");
+}
+
+int main(int argc, char* argv[]) {
+  RowMapGenerator generator;
+  return compiler::PluginMain(argc, argv, &generator);
+}
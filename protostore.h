@@ -20,17 +20,29 @@
 #include <stdio.h>
 #include <glog/logging.h>
 #include "sqlite3.h"
+#include <boost/next_prior.hpp>
 #include <boost/thread/mutex.hpp>
+#include <algorithm>
 #include <google/protobuf/descriptor.h>
 #include <string>
 #include <vector>
+#include "base.h"
 #include "messagestore.h"
 #include "protostore.pb.h"
+// Generated RowMapperFor specializations for our stored types; these must be
+// seen before any ProtoStore of those types is instantiated.
+#include "playableitem.rowmap.h"
+#include "playlist.rowmap.h"
+#include "protostore.rowmap.h"
 
 using namespace google::protobuf;
 
 namespace automation {
 
+// Continuation tokens for keyset pagination, as handed to API clients.
+std::string EncodePageToken(const PageToken& token);
+bool DecodePageToken(const std::string& encoded, PageToken *token);
+
 // Instead of having everyone use the MessageStore directly, we wrap it with a ProtoStore which
 // is type-aware.  This lets us have type safety on the cheap.  We bother with having it
 // be a separate class, in order to minimize the size of the template (and therefore
@@ -39,29 +51,125 @@ template<class TypeName> class ProtoStore : public automation::MessageStore {
  public: 
   ProtoStore(sqlite3 *db) : 
     MessageStore(db, TypeName().GetDescriptor(), TypeName().GetDescriptor()->name()) {
+    SetRowMapper(RowMapperFor<TypeName>::Get());
   }
 
   ProtoStore(sqlite3 *db, const std::string& tablename) :
     MessageStore(db, TypeName().GetDescriptor(), tablename) {
-  }
+    SetRowMapper(RowMapperFor<TypeName>::Get());
+  }
+
+  // A forward-only cursor over the rows of the store's table.  Rows are read
+  // straight off the live statement into one reused message, so walking a
+  // large table costs one row of memory rather than a vector of copies.
+  // The statement comes from the store's cache: the store must outlive the
+  // cursor, and only one cursor per store may be open at a time.
+  class Cursor {
+   public:
+    Cursor(ProtoStore *store, int64_t limit, int64_t offset) :
+      store_(store),
+      statement_(store->Statement(LOAD_ALL, store->table_, 0)) {
+      sqlite3_bind_int64(statement_->ps, 1, limit);
+      sqlite3_bind_int64(statement_->ps, 2, offset);
+    }
+    ~Cursor() {
+      sqlite3_reset(statement_->ps);
+    }
+
+    // Advances to the next row, returning false once the rows are exhausted.
+    bool Next() {
+      row_.Clear();
+      if (store_->ProtoFromRows(*statement_, &row_)) {
+        VLOG(90) << "Cursor at " << row_.DebugString();
+        return true;
+      }
+      return false;
+    }
+    const TypeName& row() const { return row_; }
+    TypeName* mutable_row() { return &row_; }
+
+   private:
+    ProtoStore *store_;
+    PreparedStatement *statement_;
+    TypeName row_;
+    DISALLOW_COPY_AND_ASSIGN(Cursor);
+  };
 
   bool LoadAll(std::vector<TypeName> *result, int64_t limit, int64_t offset) {
-    std::string query = "SELECT * from " + table_ + " LIMIT ? OFFSET ?";
-
-    sqlite3_stmt *ps;
-    CHECK(SQLITE_OK == sqlite3_prepare_v2(db_, query.c_str(), -1, &ps, NULL)) << sqlite3_errmsg(db_);
-    sqlite3_bind_int64(ps, 1, limit);
-    sqlite3_bind_int64(ps, 2, offset);
-
-    TypeName temp;
-    while (ProtoFromRows(ps, &temp)) {
-      result->push_back(temp);
-      VLOG(90) << "Adding " << temp.DebugString();
-      temp.Clear();
+    Cursor cursor(this, limit, offset);
+    while (cursor.Next()) {
+      result->push_back(cursor.row());
     }
-    CHECK(SQLITE_OK == sqlite3_reset(ps));
     return result->size();
   }
+
+  // Writes every message in [begin, end) (iterators over TypeName), reusing
+  // one prepared statement and committing once per chunk_size rows rather
+  // than once per row.  Rows rejected by a constraint are skipped and
+  // reported in errors instead of aborting the batch.  Returns the number of
+  // rows written; inserted rows have their IDs filled in.
+  template<class Iterator>
+  int InsertBatch(Iterator begin, Iterator end, std::vector<RowError> *errors,
+                  size_t chunk_size = kDefaultChunkSize) {
+    return WriteBatch(begin, end, INSERT, errors, chunk_size);
+  }
+  template<class Iterator>
+  int ReplaceBatch(Iterator begin, Iterator end, std::vector<RowError> *errors,
+                   size_t chunk_size = kDefaultChunkSize) {
+    return WriteBatch(begin, end, REPLACE, errors, chunk_size);
+  }
+  // Every row must have its ID; only the fields set are written.
+  template<class Iterator>
+  int UpdateBatch(Iterator begin, Iterator end, std::vector<RowError> *errors,
+                  size_t chunk_size = kDefaultChunkSize) {
+    return WriteBatch(begin, end, UPDATE, errors, chunk_size);
+  }
+
+ private:
+  template<class Iterator>
+  int WriteBatch(Iterator begin, Iterator end, Operation op, std::vector<RowError> *errors, size_t chunk_size) {
+    CHECK(chunk_size > 0);
+    int written = 0;
+    size_t index = 0, in_chunk = 0, chunk_errors = 0;
+    std::vector<size_t> chunk_written;
+    std::vector<const TypeName *> chunk_rows;
+    std::string commit_error;
+    for (Iterator it = begin; it != end; ++it, ++index) {
+      if (in_chunk++ == 0) {
+        BeginBatch();
+        chunk_errors = errors->size();
+      }
+      TypeName *value = &*it;
+      if (WriteBatchRow(value, op, index, errors)) {
+        chunk_written.push_back(index);
+        chunk_rows.push_back(value);
+      }
+      if (in_chunk == chunk_size || boost::next(it) == end) {
+        if (CommitBatch(&commit_error)) {
+          written += chunk_written.size();
+          for (typename std::vector<const TypeName *>::iterator r = chunk_rows.begin(); r != chunk_rows.end(); ++r) {
+            NotifyWritten(**r);
+          }
+        } else {
+          // The whole chunk was rolled back, including rows we thought
+          // had been written.
+          for (std::vector<size_t>::iterator c = chunk_written.begin(); c != chunk_written.end(); ++c) {
+            errors->push_back(RowError(*c, SQLITE_CONSTRAINT, commit_error));
+          }
+          // Only this chunk's errors are out of order; leave whatever the
+          // caller or earlier chunks put there alone.
+          std::sort(errors->begin() + chunk_errors, errors->end(), RowErrorLess);
+        }
+        chunk_written.clear();
+        chunk_rows.clear();
+        in_chunk = 0;
+      }
+    }
+    return written;
+  }
+  static bool RowErrorLess(const RowError& a, const RowError& b) {
+    return a.index < b.index;
+  }
 };
 
 template<class TypeName> class ThreadSafeProto : public ProtoStore<TypeName> {
@@ -0,0 +1,118 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <boost/bind.hpp>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+#include "readahead.h"
+
+DEFINE_int32(readahead_mb, 4, "Megabytes from the start of the next track to read into the page "
+  "cache while the current one plays; 0 to only check that it exists.");
+
+Readahead::Readahead() :
+  warmed_ok_(true),
+  stopping_(false) {
+}
+
+Readahead::~Readahead() {
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stopping_ = true;
+    work_.notify_all();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void Readahead::Warm(const std::string& filename) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (filename == warmed_ || filename == pending_) {
+    return;
+  }
+  pending_ = filename;
+  if (!thread_.joinable()) {
+    // Not until there's something to warm, so that the one-shot tools
+    // (acmd), which never play anything, never start it.
+    thread_ = boost::thread(boost::bind(&Readahead::Run, this));
+  }
+  work_.notify_one();
+}
+
+bool Readahead::Unreadable(const std::string& filename) {
+  boost::mutex::scoped_lock lock(mutex_);
+  return filename == warmed_ && !warmed_ok_;
+}
+
+bool Readahead::WarmFile(const std::string& filename) {
+  struct stat info;
+  if (stat(filename.c_str(), &info) != 0) {
+    LOG(WARNING) << "Next track " << filename << " is missing: " << strerror(errno);
+    return false;
+  }
+  if (!S_ISREG(info.st_mode)) {
+    LOG(WARNING) << "Next track " << filename << " is not a regular file (mode "
+                 << std::oct << info.st_mode << std::dec << ")";
+    return false;
+  }
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd == -1) {
+    LOG(WARNING) << "Unable to open next track " << filename << ": " << strerror(errno);
+    return false;
+  }
+  off_t length = static_cast<off_t>(FLAGS_readahead_mb) << 20;
+  if (length > info.st_size) {
+    length = info.st_size;
+  }
+  if (length > 0) {
+    posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+#ifdef __linux__
+    // WILLNEED only starts the reads; wait for them, since we're on our own
+    // thread anyway and would rather know they're done.
+    readahead(fd, 0, length);
+#endif
+  }
+  close(fd);
+  VLOG(5) << "Warmed " << length << " bytes of " << filename;
+  return true;
+}
+
+void Readahead::Run() {
+  boost::mutex::scoped_lock lock(mutex_);
+  while (true) {
+    while (!stopping_ && pending_.empty()) {
+      work_.wait(lock);
+    }
+    if (stopping_) {
+      break;
+    }
+    std::string filename;
+    filename.swap(pending_);
+    lock.unlock();
+
+    bool ok = WarmFile(filename);
+
+    lock.lock();
+    warmed_ = filename;
+    warmed_ok_ = ok;
+  }
+}
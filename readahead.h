@@ -0,0 +1,63 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <string>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "base.h"
+
+// Readahead checks that the track we expect to play next is there and
+// pulls the start of it into the page cache, from a thread of its own, while
+// the current track plays.  On a slow (say, NFS-backed) library that read is
+// otherwise the bulk of the dead air between tracks.  The thread is started
+// by the first Warm().
+class Readahead {
+ public:
+  Readahead();
+  ~Readahead();
+
+  // Queues filename to be warmed, replacing anything queued but not yet
+  // started.
+  void Warm(const std::string& filename);
+
+  // True if filename was the last file warmed and couldn't be opened.  The
+  // caller should check again itself before giving up on it.
+  bool Unreadable(const std::string& filename);
+
+  // Whether filename can be opened, and if so reads its first
+  // --readahead_mb into the page cache.
+  static bool WarmFile(const std::string& filename);
+
+ private:
+  void Run();
+
+  // mutex_ guards everything below.
+  boost::mutex mutex_;
+  boost::condition_variable work_;  // Signalled when pending_ is set.
+  std::string pending_;
+  std::string warmed_;              // The last file warmed, and whether
+  bool warmed_ok_;                  // it could be opened.
+  bool stopping_;
+
+  boost::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(Readahead);
+};
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include <glog/logging.h>
+#include "regexfilter.h"
+
+RegexFilter::RegexFilter(const std::string& pattern) :
+  literal_(RequiredLiteral(pattern))
+#ifdef USE_RE2
+  , re_("(?i)" + pattern)
+#endif
+  {
+#ifdef USE_RE2
+  ok_ = re_.ok();
+#else
+  ok_ = !regcomp(&re_, pattern.c_str(), REG_ICASE | REG_EXTENDED | REG_NOSUB);
+#endif
+  VLOG(10) << "Filtering on " << pattern << " with prefilter \"" << literal_ << "\"";
+}
+
+RegexFilter::~RegexFilter() {
+#ifndef USE_RE2
+  if (ok_) {
+    regfree(&re_);
+  }
+#endif
+}
+
+bool RegexFilter::Matches(const std::string& text) const {
+  if (!literal_.empty() && !strcasestr(text.c_str(), literal_.c_str())) {
+    return false;
+  }
+#ifdef USE_RE2
+  return RE2::PartialMatch(text, re_);
+#else
+  return !regexec(&re_, text.c_str(), 0, NULL, 0);
+#endif
+}
+
+// Whether c can be part of a literal compared with strcasestr.  That only
+// folds ASCII, so nothing else qualifies; nor do k and s, which also match
+// the Kelvin sign and the long s when case is ignored.
+static bool IsPlain(char c) {
+  return c >= ' ' && c <= '~' && !strchr("kKsS", c);
+}
+
+// The index of the character closing the bracket expression opening at i.
+static size_t SkipBracket(const std::string& pattern, size_t i) {
+  size_t j = i + 1;
+  if (j < pattern.size() && pattern[j] == '^') {
+    j++;
+  }
+  if (j < pattern.size() && pattern[j] == ']') {
+    j++;
+  }
+  for (; j < pattern.size() && pattern[j] != ']'; ++j) {
+    if (pattern[j] == '[' && j + 1 < pattern.size() && strchr(":.=", pattern[j + 1])) {
+      size_t close = pattern.find(std::string(1, pattern[j + 1]) + "]", j + 2);
+      if (close == std::string::npos) {
+        return pattern.size();
+      }
+      j = close + 1;
+    } else if (pattern[j] == '\\') {
+      j++;
+    }
+  }
+  return j;
+}
+
+// The index of the ')' closing the group opening at i.
+static size_t SkipGroup(const std::string& pattern, size_t i) {
+  int depth = 0;
+  for (size_t j = i; j < pattern.size(); ++j) {
+    switch (pattern[j]) {
+    case '\\':
+      j++;
+      break;
+    case '[':
+      j = SkipBracket(pattern, j);
+      break;
+    case '(':
+      depth++;
+      break;
+    case ')':
+      if (--depth == 0) {
+        return j;
+      }
+      break;
+    }
+  }
+  return pattern.size();
+}
+
+std::string RegexFilter::RequiredLiteral(const std::string& pattern) {
+  // With alternation anywhere, no one string has to be there.
+  if (pattern.find('|') != std::string::npos) {
+    return "";
+  }
+  std::string best, run;
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    char c = pattern[i];
+    bool flush = true;
+    switch (c) {
+    case '*':
+    case '?':
+    case '{':
+      // The character before may not be there at all.
+      if (!run.empty()) {
+        run.erase(run.size() - 1);
+      }
+      if (c == '{') {
+        i = std::min(pattern.find('}', i), pattern.size());
+      }
+      break;
+    case '+':
+      break;  // It's there at least once, but whatever follows needn't be next to it.
+    case '(':
+      i = SkipGroup(pattern, i);  // Groups may be optional; don't look inside.
+      break;
+    case '[':
+      i = SkipBracket(pattern, i);
+      break;
+    case '\\':
+      if (i + 1 < pattern.size() && !isalnum(pattern[i + 1]) && IsPlain(pattern[i + 1])) {
+        run += pattern[++i];
+        flush = false;
+      } else if (i + 1 < pattern.size() && strchr("pPxQ", pattern[i + 1])) {
+        // Unicode classes, hex escapes and \Q...\E quoting: give up here
+        // rather than work out how far they reach.
+        return best.size() >= run.size() ? best : run;
+      } else {
+        i++;  // \d, \b, \1 and the like.
+      }
+      break;
+    default:
+      if (IsPlain(c) && !strchr(".^$)", c)) {
+        run += c;
+        flush = false;
+      }
+    }
+    if (flush) {
+      if (run.size() > best.size()) {
+        best = run;
+      }
+      run.clear();
+    }
+  }
+  return run.size() > best.size() ? run : best;
+}
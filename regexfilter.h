@@ -0,0 +1,62 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef REGEXFILTER_H
+#define REGEXFILTER_H
+
+#include <string>
+#include "base.h"
+#ifdef USE_RE2
+#include <re2/re2.h>
+#else
+#include <sys/types.h>
+#include <regex.h>
+#endif
+
+// A case-insensitive regular expression, as used by Playlist::Filter, that
+// rules out most non-matching text before running the expression itself:
+// a string the pattern can't match without (say "beatles" in
+// "beatles.*live") is looked for first, with a plain substring search.
+//
+// Matches may be called from several threads at once, but glibc holds a
+// lock on the compiled POSIX expression for the whole of regexec, so threads
+// sharing one filter take turns; give each thread its own.
+class RegexFilter {
+ public:
+  explicit RegexFilter(const std::string& pattern);
+  ~RegexFilter();
+
+  bool ok() const { return ok_; }
+  // True if the pattern matches anywhere in text.
+  bool Matches(const std::string& text) const;
+
+  // The longest run of plain characters that every match of pattern must
+  // contain, or "" if we can't tell.  Only ever errs towards "": "colou?r"
+  // gives "colo", "a[bc]d efg" gives "d efg" and "foo|bar" gives "".
+  static std::string RequiredLiteral(const std::string& pattern);
+
+ private:
+  bool ok_;
+  std::string literal_;
+#ifdef USE_RE2
+  RE2 re_;
+#else
+  regex_t re_;
+#endif
+
+  DISALLOW_COPY_AND_ASSIGN(RegexFilter);
+};
+
+#endif
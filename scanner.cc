@@ -0,0 +1,252 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <algorithm>
+#include <set>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <glog/logging.h>
+#include "catalog.h"
+#include "ingest.h"
+#include "scanner.h"
+
+Scanner::Scanner(sqlite3 *db, int walkers) :
+  db_(CHECK_NOTNULL(db)),
+  walkers_(std::max(walkers, 1)),
+  busy_(0) {
+}
+
+bool Scanner::Scan(const std::string& root, Ingest *ingest, FILE *out) {
+  char resolved[PATH_MAX];
+  struct stat info;
+  if (!realpath(root.c_str(), resolved) || stat(resolved, &info) || !S_ISDIR(info.st_mode)) {
+    LOG(ERROR) << "Unable to scan " << root << ": not a directory";
+    ingest->Finish();
+    return false;
+  }
+  std::string top(resolved);
+  if (top == "/") {
+    top.clear();
+  }
+
+  FingerprintMap known;
+  LoadFingerprints(top, &known);
+  ingest->set_listener(boost::bind(&Scanner::Resolved, this, _1, _2));
+
+  directories_.push_back(top.empty() ? "/" : top);
+  boost::thread_group walkers;
+  for (int i = 0; i < walkers_; ++i) {
+    walkers.create_thread(boost::bind(&Scanner::Walk, this));
+  }
+  walkers.join_all();
+
+  FileList probed;
+  for (FileList::iterator it = files_.begin(); it != files_.end(); ++it) {
+    FingerprintMap::iterator old = known.find(it->first);
+    if (old == known.end()) {
+      ingest->Add(it->first);
+    } else if (old->second == it->second) {
+      old->second.seen = true;
+      if (old->second.id >= 0 && old->second.own && !old->second.hashed) {
+        ingest->Hash(it->first, old->second.id, old->second.duration);
+      } else if (old->second.id >= 0) {
+        fprintf(out, "%lld\t%s\n", old->second.id, it->first.c_str());
+      }
+      continue;
+    } else {
+      old->second.seen = true;
+      if (old->second.id >= 0 && old->second.own) {
+        ingest->Refresh(it->first, old->second.id);
+      } else {
+        ingest->Add(it->first);  // It might be playable now.
+      }
+    }
+    probed.push_back(*it);
+  }
+  ingest->Finish();
+  ingest->set_listener(Ingest::Listener());
+
+  // An item whose file changed and can no longer be played is marked
+  // missing, and its old fingerprint kept, so that the next scan probes
+  // the file again rather than taking it for unplayable and unchanged.
+  FileList saved;
+  std::set<sqlite3_int64> unplayable;
+  for (FileList::iterator it = probed.begin(); it != probed.end(); ++it) {
+    FingerprintMap::iterator old = known.find(it->first);
+    std::map<std::string, sqlite3_int64>::iterator id = resolved_.find(it->first);
+    if (old != known.end() && old->second.id >= 0 && old->second.own &&
+        (id == resolved_.end() || id->second < 0)) {
+      unplayable.insert(old->second.id);
+    } else {
+      saved.push_back(*it);
+    }
+  }
+  SaveFingerprints(saved);
+
+  // Items that a new file took over (as it was moved there) haven't gone.
+  std::set<sqlite3_int64> kept;
+  for (std::map<std::string, sqlite3_int64>::iterator it = resolved_.begin(); it != resolved_.end(); ++it) {
+    kept.insert(it->second);
+  }
+  int vanished = 0;
+  for (FingerprintMap::iterator it = known.begin(); it != known.end(); ++it) {
+    if (it->second.id < 0 || !it->second.own) {
+      continue;
+    }
+    if (unplayable.count(it->second.id)) {
+      if (!it->second.missing) {
+        Catalog::get()->SetMissing(db_, it->second.id, true);
+      }
+    } else if (it->second.seen || kept.count(it->second.id)) {
+      if (it->second.missing) {
+        Catalog::get()->SetMissing(db_, it->second.id, false);
+        LOG(INFO) << "Item " << it->second.id << " is back: " << it->first;
+      }
+    } else if (!it->second.missing && Catalog::get()->FileGone(db_, it->second.id, it->first)) {
+      vanished++;
+    }
+  }
+  LOG(INFO) << "Scanned " << files_.size() << " files under " << resolved << ": " << probed.size()
+            << " new or changed, " << vanished << " items gone, " << unplayable.size() << " unplayable.";
+  files_.clear();
+  resolved_.clear();
+  return true;
+}
+
+// The fingerprints of the files under root, with what is known of their
+// items.  One whose item has since been deleted is left out, so that the
+// file is treated as new.
+void Scanner::LoadFingerprints(const std::string& root, FingerprintMap *known) {
+  sqlite3_stmt *ps;
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_,
+      "SELECT f.filename, f.inode, f.size, f.mtime, f.PlayableItemID, p.duration,"
+      "       p.filename = f.filename, p.contenthash IS NOT NULL, m.PlayableItemID IS NOT NULL"
+      "  FROM FileFingerprint f LEFT JOIN PlayableItem p ON p.PlayableItemID = f.PlayableItemID"
+      "                         LEFT JOIN MissingItem m ON m.PlayableItemID = f.PlayableItemID"
+      "  WHERE f.filename > ?1 || '/' AND f.filename < ?1 || '0' "
+      "    AND (f.PlayableItemID IS NULL OR p.PlayableItemID IS NOT NULL)",
+      -1, &ps, NULL)) << sqlite3_errmsg(db_);
+  sqlite3_bind_text(ps, 1, root.data(), root.size(), SQLITE_STATIC);
+  while (sqlite3_step(ps) == SQLITE_ROW) {
+    Fingerprint& fingerprint = (*known)[reinterpret_cast<const char *>(sqlite3_column_text(ps, 0))];
+    fingerprint.inode = sqlite3_column_int64(ps, 1);
+    fingerprint.size = sqlite3_column_int64(ps, 2);
+    fingerprint.mtime = sqlite3_column_int64(ps, 3);
+    fingerprint.id = sqlite3_column_type(ps, 4) == SQLITE_NULL ? -1 : sqlite3_column_int64(ps, 4);
+    fingerprint.duration = sqlite3_column_int64(ps, 5);
+    fingerprint.own = sqlite3_column_int(ps, 6);
+    fingerprint.hashed = sqlite3_column_int(ps, 7);
+    fingerprint.missing = sqlite3_column_int(ps, 8);
+  }
+  sqlite3_finalize(ps);
+}
+
+// Records the fingerprints of files just probed, along with the items they
+// ended up as, if any.
+void Scanner::SaveFingerprints(const FileList& files) {
+  sqlite3_stmt *ps;
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_,
+      "REPLACE INTO FileFingerprint (filename, inode, size, mtime, PlayableItemID) "
+      "  VALUES (?1, ?2, ?3, ?4, ?5)",
+      -1, &ps, NULL)) << sqlite3_errmsg(db_);
+  CHECK(sqlite3_exec(db_, "BEGIN TRANSACTION", NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
+  for (FileList::const_iterator it = files.begin(); it != files.end(); ++it) {
+    sqlite3_bind_text(ps, 1, it->first.data(), it->first.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(ps, 2, it->second.inode);
+    sqlite3_bind_int64(ps, 3, it->second.size);
+    sqlite3_bind_int64(ps, 4, it->second.mtime);
+    std::map<std::string, sqlite3_int64>::const_iterator id = resolved_.find(it->first);
+    if (id != resolved_.end() && id->second >= 0) {
+      sqlite3_bind_int64(ps, 5, id->second);
+    } else {
+      sqlite3_bind_null(ps, 5);
+    }
+    CHECK(sqlite3_step(ps) == SQLITE_DONE) << sqlite3_errmsg(db_);
+    sqlite3_reset(ps);
+  }
+  CHECK(sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL) == SQLITE_OK) << sqlite3_errmsg(db_);
+  sqlite3_finalize(ps);
+}
+
+void Scanner::Resolved(const std::string& filename, sqlite3_int64 id) {
+  boost::mutex::scoped_lock lock(mutex_);
+  resolved_[filename] = id;
+}
+
+void Scanner::Walk() {
+  boost::mutex::scoped_lock lock(mutex_);
+  while (true) {
+    while (directories_.empty() && busy_) {
+      work_.wait(lock);
+    }
+    if (directories_.empty()) {
+      break;  // Nobody is reading a directory, so there are no more to come.
+    }
+    std::string path = directories_.front();
+    directories_.pop_front();
+    busy_++;
+    lock.unlock();
+
+    std::vector<std::string> directories;
+    FileList files;
+    ReadDirectory(path, &directories, &files);
+
+    lock.lock();
+    busy_--;
+    directories_.insert(directories_.end(), directories.begin(), directories.end());
+    files_.insert(files_.end(), files.begin(), files.end());
+    work_.notify_all();
+  }
+}
+
+// Lists the regular files and directories in path.  Like find, symlinks
+// aren't followed.
+void Scanner::ReadDirectory(const std::string& path, std::vector<std::string> *directories,
+                            FileList *files) {
+  DIR *dir = opendir(path.c_str());
+  if (!dir) {
+    LOG(WARNING) << "Unable to read " << path << ": " << strerror(errno);
+    return;
+  }
+  std::string prefix = path == "/" ? path : path + "/";
+  while (struct dirent *entry = readdir(dir)) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+    std::string filename = prefix + entry->d_name;
+    struct stat info;
+    if (lstat(filename.c_str(), &info)) {
+      continue;  // Gone already.
+    }
+    if (S_ISDIR(info.st_mode)) {
+      directories->push_back(filename);
+    } else if (S_ISREG(info.st_mode)) {
+      Fingerprint fingerprint;
+      fingerprint.inode = info.st_ino;
+      fingerprint.size = info.st_size;
+      fingerprint.mtime = info.st_mtime;
+      files->push_back(std::make_pair(filename, fingerprint));
+    }
+  }
+  closedir(dir);
+}
@@ -0,0 +1,93 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include <stdio.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include "base.h"
+#include "sqlite3.h"
+
+class Ingest;
+
+// Scanner brings the library up to date with a directory tree, for acmd
+// --command=scan.  Each file's (inode, size, mtime) is compared with the
+// fingerprint recorded when it was last scanned: files that are new go to an
+// Ingest to be added, files that have changed to be probed again, and files
+// that haven't are printed as they are ("ID\tfilename") without touching
+// them.  Items whose files no longer exist are marked missing (see
+// Catalog::FileGone), as are items whose files have changed and can no
+// longer be played; those marked missing whose files are back (and
+// playable) again are unmarked.  A file whose item was stored before items
+// had content hashes is sent to have its hash recorded, once, rather than
+// probed.
+//
+// Directories are read by several threads at once; the database is only
+// used from the caller's thread, before and after the Ingest runs.
+class Scanner {
+ public:
+  Scanner(sqlite3 *db, int walkers);
+
+  // Scans everything under root, finishing ingest.  Returns false if root
+  // can't be read.
+  bool Scan(const std::string& root, Ingest *ingest, FILE *out);
+
+ private:
+  struct Fingerprint {
+    Fingerprint() : inode(0), size(0), mtime(0), id(-1), duration(0), own(false), hashed(false),
+                    missing(false), seen(false) {}
+    bool operator==(const Fingerprint& other) const {
+      return inode == other.inode && size == other.size && mtime == other.mtime;
+    }
+    sqlite3_int64 inode;
+    sqlite3_int64 size;
+    sqlite3_int64 mtime;
+    sqlite3_int64 id;  // The PlayableItemID, or -1 if the file isn't playable.
+    sqlite3_int64 duration;
+    bool own;          // The item is this file, rather than a copy of it elsewhere.
+    bool hashed;       // The item has a content hash.
+    bool missing;      // The item is marked missing.
+    bool seen;
+  };
+  typedef std::map<std::string, Fingerprint> FingerprintMap;
+  typedef std::vector<std::pair<std::string, Fingerprint> > FileList;
+
+  void LoadFingerprints(const std::string& root, FingerprintMap *known);
+  void SaveFingerprints(const FileList& files);
+  void Resolved(const std::string& filename, sqlite3_int64 id);
+  void Walk();
+  void ReadDirectory(const std::string& path, std::vector<std::string> *directories, FileList *files);
+
+  sqlite3 *db_;
+  const int walkers_;
+
+  // mutex_ guards everything below.
+  boost::mutex mutex_;
+  boost::condition_variable work_;  // Signalled when directories_ grows or busy_ drops.
+  std::deque<std::string> directories_;
+  int busy_;                        // Walkers reading a directory.
+  FileList files_;
+  std::map<std::string, sqlite3_int64> resolved_;  // The IDs the Ingest printed.
+
+  DISALLOW_COPY_AND_ASSIGN(Scanner);
+};
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/thread/mutex.hpp>
+#include <gflags/gflags.h>
+#include "shuffle.h"
+
+DEFINE_int32(shuffle_seed, 0, "Seed for playlist shuffles; 0 picks one from the clock.  Runs "
+  "with the same seed and the same database play in the same order.");
+
+static boost::mutex generator_mutex;
+
+// Compares keys only; members with equal keys are left for the shuffle.
+static bool KeyLess(const KeyedMember& a, const KeyedMember& b) {
+  return a.first < b.first;
+}
+
+void ShuffleByKey(std::vector<KeyedMember> *members) {
+  std::sort(members->begin(), members->end(), KeyLess);
+
+  boost::mutex::scoped_lock lock(generator_mutex);
+  static boost::random::mt19937 generator(
+      FLAGS_shuffle_seed ? FLAGS_shuffle_seed : static_cast<int>(time(NULL) ^ getpid()));
+  std::vector<KeyedMember>::iterator bucket = members->begin();
+  while (bucket != members->end()) {
+    std::vector<KeyedMember>::iterator end =
+        std::upper_bound(bucket, members->end(), *bucket, KeyLess);
+    for (size_t i = end - bucket - 1; i > 0; --i) {
+      boost::random::uniform_int_distribution<size_t> pick(0, i);
+      std::swap(bucket[i], bucket[pick(generator)]);
+    }
+    bucket = end;
+  }
+}
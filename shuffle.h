@@ -0,0 +1,31 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef SHUFFLE_H
+#define SHUFFLE_H
+
+#include <utility>
+#include <vector>
+#include "sqlite3.h"
+
+// A playlist member and the key it is ordered by.
+typedef std::pair<sqlite3_int64, sqlite3_int64> KeyedMember;  // (key, PlayableItemID)
+
+// Puts members in play order: ascending by key, and shuffled (Fisher-Yates)
+// among members with equal keys.  Every shuffle in the process draws on one
+// generator, seeded from --shuffle_seed so that a run can be reproduced.
+void ShuffleByKey(std::vector<KeyedMember> *members);
+
+#endif
@@ -16,6 +16,7 @@
 
 
 #include "automationstate.h"
+#include "catalog.h"
 #include <exception>
 #include <gflags/gflags.h>
 #include <glog/logging.h>  
@@ -66,7 +67,7 @@ class RequirementsCommand : public WebCommand {
   const std::string get_command() { return "/requirements"; }
   void handle_command(HTTPRequestPtr& request, HTTPResponseWriterPtr writer, const std::string& remote_user) {
     AutomationState *as = AutomationState::get_state();
-    DatabaseHandle db(DatabaseOpen());
+    DatabaseHandle db(DatabaseHandle::READ);
     if (request->getResource() == "/requirements/fetch") {
       automation::Schedule output;
       as->get_requirement_engine()->CopyTo(&output);
@@ -121,12 +122,15 @@ class SQLCommand : public WebCommand {
     }
     const char *cmd = request_->getContent();
     char *errmsg;
-    DatabaseHandle db(DatabaseOpen());
+    DatabaseHandle db(DatabaseHandle::WRITE);
     automation::SQLResult result;
     LOG(INFO) << "SQL API: " << cmd;
     if (sqlite3_exec(db, cmd, &SQLResult::AddRow, &result, &errmsg) != SQLITE_OK) {
       sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
     }
+    // There's no telling what the statement touched.
+    Catalog::get()->Invalidate();
+    Playlist::WeightsChanged();
     if (errmsg) {
       writer << errmsg;
       sqlite3_free(errmsg);
@@ -142,7 +146,8 @@ class PlaylistCommand : public WebCommand {
   void handle_command(HTTPRequestPtr& request, HTTPResponseWriterPtr writer, const std::string& remote_user) {
     using automation::ProtoStore;
     HTTPTypes::QueryParams& params = request->getQueryParams(); 
-    DatabaseHandle db(DatabaseOpen());
+    bool writes = request->getResource().find("/playlist/update") != std::string::npos || params_.count("alsosave");
+    DatabaseHandle db(writes ? DatabaseHandle::WRITE : DatabaseHandle::READ);
     ProtoStore<automation::Playlist> pstore(db);
 
     PlaylistPtr ptr;
@@ -166,7 +171,13 @@ class PlaylistCommand : public WebCommand {
         LOG(INFO) << "Nope " << lookup.data().DebugString();
       }
     } else if (request->getResource().find("/playlist/all") != std::string::npos) {
-      ReturnMessage(Playlist::FetchAllLists(db));
+      if (ArgumentOrDefault<std::string>("format", "pb") == "json") {
+        ReturnMessage(Playlist::FetchAllLists(db));
+      } else {
+        // pb and debugpb encodings of a repeated field are just the
+        // concatenation of its elements, so write each list as we read it.
+        Playlist::VisitAllLists(db, boost::bind(&PlaylistCommand::ReturnList, this, _1));
+      }
     } else if (request->getResource().find("/playlist/update") != std::string::npos) {
       automation::PlaylistMergeRequest update_request = LoadMessage<automation::PlaylistMergeRequest>();
       bool overwrite = false;
@@ -196,6 +207,11 @@ class PlaylistCommand : public WebCommand {
       LOG(WARNING) << "Unknown resource " << request->getResource();
     }
   }
+  void ReturnList(const automation::Playlist& list) {
+    automation::Playlists wrapper;
+    wrapper.add_item()->CopyFrom(list);
+    ReturnMessage(wrapper);
+  }
   PlaylistPtr GetNewlist(sqlite3 *db) {
     char buf[128];
     int newnum = 0;
@@ -211,10 +227,23 @@ class PlaylistCommand : public WebCommand {
     if (params_.count("fetchall")) {
       PlaylistPtr lookup(new Playlist(db));
       int64_t limit = ArgumentOrDefault<int64_t>("limit", LLONG_MAX);
+      if (params_.count("pagetoken")) {
+        if (!lookup->FetchSuperlistPage(limit, params_.equal_range("pagetoken").first->second)) {
+          return PlaylistPtr();  // A malformed token, not the end of the library.
+        }
+        return lookup;
+      }
       int64_t offset = ArgumentOrDefault<int64_t>("offset", 0);
       lookup->FetchSuperlist(limit, offset);
       return lookup; 
     }
+    if (params_.count("search")) {
+      PlaylistPtr lookup(new Playlist(db));
+      lookup->FetchSearch(params_.equal_range("search").first->second,
+                          ArgumentOrDefault<int64_t>("limit", 100),
+                          ArgumentOrDefault<int64_t>("offset", 0));
+      return lookup;
+    }
     if (params_.count("mainshow")) {
       return AutomationState::get_state()->GetMainshow();
     }
@@ -248,6 +277,9 @@ class PlaylistCommand : public WebCommand {
       } else {
         output.clear_playableitemid();
       }
+    } else if (params_.count("search") && !params_.count("noitems") && !params_.count("alsosave")) {
+      output = input->Items();
+      output.clear_playableitemid();
     } else {
       input->CopyTo(&output);
       output.clear_items();
@@ -259,6 +291,10 @@ class PlaylistCommand : public WebCommand {
     while(output.items_size() > ArgumentOrDefault<int64_t>("truncate", LLONG_MAX)) {
       output.mutable_items()->RemoveLast();
     }
+    std::string next_page_token = input->next_page_token();
+    if (!next_page_token.empty()) {
+      output.set_next_page_token(next_page_token);
+    }
 
     ReturnMessage(output);
   }
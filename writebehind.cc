@@ -0,0 +1,190 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <glog/logging.h>
+#include "catalog.h"
+#include "writebehind.h"
+
+WriteBehind *WriteBehind::instance_;
+
+WriteBehind::WriteBehind(sqlite3 *db, size_t capacity) :
+  db_(CHECK_NOTNULL(db)),
+  capacity_(capacity),
+  playcount_(NULL),
+  lock_(NULL),
+  writing_(false),
+  stopping_(false) {
+  CHECK(instance_ == NULL) << "Only one WriteBehind may exist at a time.";
+  CHECK(capacity_ > 0);
+  // We share the file with every other connection; rather than failing a
+  // batch as soon as one of them holds the write lock, wait a while for it.
+  sqlite3_busy_timeout(db_, 5000);
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_,
+      "UPDATE PlayableItem SET playcount = coalesce(playcount, 0) + ? WHERE PlayableItemID = ?",
+      -1, &playcount_, NULL)) << sqlite3_errmsg(db_);
+  CHECK(SQLITE_OK == sqlite3_prepare_v2(db_, "REPLACE INTO PlaylistLock (name) VALUES (?)",
+      -1, &lock_, NULL)) << sqlite3_errmsg(db_);
+  thread_ = boost::thread(boost::bind(&WriteBehind::Run, this));
+  instance_ = this;
+}
+
+WriteBehind::~WriteBehind() {
+  instance_ = NULL;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stopping_ = true;
+    work_.notify_all();
+  }
+  thread_.join();
+  sqlite3_finalize(playcount_);
+  sqlite3_finalize(lock_);
+  sqlite3_close_v2(db_);
+}
+
+void WriteBehind::IncrementPlaycount(sqlite3_int64 playableitemid) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (!playcounts_.count(playableitemid)) {
+    WaitForRoom(&lock);
+  }
+  playcounts_[playableitemid]++;
+  work_.notify_one();
+}
+
+void WriteBehind::LockPlaylist(const std::string& name) {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (locked_.count(name) || locks_.count(name)) {
+    return;
+  }
+  WaitForRoom(&lock);
+  locks_.insert(name);
+  work_.notify_one();
+}
+
+bool WriteBehind::Flush(const boost::posix_time::time_duration& timeout) {
+  boost::system_time deadline = boost::get_system_time() + timeout;
+  boost::mutex::scoped_lock lock(mutex_);
+  // As in the destructor: one more try at a batch that fails, not a retry
+  // every half second until the database frees up.
+  stopping_ = true;
+  work_.notify_all();
+  while (writing_ || pending_locked()) {
+    if (!idle_.timed_wait(lock, deadline)) {
+      LOG(ERROR) << "Giving up on " << pending_locked() << " background writes after "
+                 << timeout.total_seconds() << "s.";
+      return false;
+    }
+  }
+  return true;
+}
+
+void WriteBehind::WaitForRoom(boost::mutex::scoped_lock *lock) {
+  while (pending_locked() >= capacity_) {
+    LOG_EVERY_N(WARNING, 100) << "Background write queue full; waiting for the database.";
+    idle_.wait(*lock);
+  }
+}
+
+void WriteBehind::Run() {
+  boost::mutex::scoped_lock lock(mutex_);
+  while (true) {
+    while (!stopping_ && !pending_locked()) {
+      work_.wait(lock);
+    }
+    if (!pending_locked()) {
+      break; // stopping_, and everything has been written.
+    }
+
+    PlaycountMap playcounts;
+    NameSet locks;
+    playcounts.swap(playcounts_);
+    locks.swap(locks_);
+    writing_ = true;
+    lock.unlock();
+
+    bool written = WriteBatch(playcounts, locks);
+
+    lock.lock();
+    writing_ = false;
+    if (written) {
+      locked_.insert(locks.begin(), locks.end());
+    } else {
+      // Put the batch back, merged with whatever arrived in the meantime.
+      for (PlaycountMap::iterator it = playcounts.begin(); it != playcounts.end(); ++it) {
+        playcounts_[it->first] += it->second;
+      }
+      locks_.insert(locks.begin(), locks.end());
+    }
+    idle_.notify_all();
+    if (!written && stopping_) {
+      LOG(ERROR) << "Giving up on " << pending_locked() << " background writes at shutdown.";
+      playcounts_.clear();
+      locks_.clear();
+      break;
+    }
+    if (!written) {
+      lock.unlock();
+      boost::this_thread::sleep(boost::posix_time::milliseconds(500));
+      lock.lock();
+    }
+  }
+  idle_.notify_all();
+}
+
+bool WriteBehind::WriteBatch(const PlaycountMap& playcounts, const NameSet& locks) {
+  VLOG(10) << "Writing " << playcounts.size() << " playcounts and " << locks.size() << " locks";
+  int rc = sqlite3_exec(db_, "BEGIN TRANSACTION", NULL, NULL, NULL);
+  if (rc != SQLITE_OK) {
+    LOG(WARNING) << "Unable to start background write, will retry: " << sqlite3_errmsg(db_);
+    return false;
+  }
+
+  rc = SQLITE_DONE;
+  for (PlaycountMap::const_iterator it = playcounts.begin(); rc == SQLITE_DONE && it != playcounts.end(); ++it) {
+    sqlite3_bind_int(playcount_, 1, it->second);
+    sqlite3_bind_int64(playcount_, 2, it->first);
+    rc = sqlite3_step(playcount_);
+    sqlite3_reset(playcount_);
+  }
+  for (NameSet::const_iterator it = locks.begin(); rc == SQLITE_DONE && it != locks.end(); ++it) {
+    sqlite3_bind_text(lock_, 1, it->c_str(), it->size(), SQLITE_TRANSIENT);
+    rc = sqlite3_step(lock_);
+    sqlite3_reset(lock_);
+  }
+  if (rc == SQLITE_DONE) {
+    rc = sqlite3_exec(db_, "COMMIT", NULL, NULL, NULL);
+  }
+  if (rc == SQLITE_OK) {
+    for (PlaycountMap::const_iterator it = playcounts.begin(); it != playcounts.end(); ++it) {
+      Catalog::get()->AddPlaycount(it->first, it->second);
+    }
+    return true;
+  }
+
+  // The lock's reference to Playlist(name) is deferred, so a missing
+  // playlist shows up here, at commit.
+  if (rc == SQLITE_CONSTRAINT) {
+    std::string names;
+    for (NameSet::const_iterator it = locks.begin(); it != locks.end(); ++it) {
+      names += " " + *it;
+    }
+    LOG(FATAL) << "Unable to lock mandatory playlist:" << names << " - does it exist?";
+  }
+  LOG(WARNING) << "Background write failed, will retry: " << sqlite3_errmsg(db_);
+  sqlite3_exec(db_, "ROLLBACK", NULL, NULL, NULL);
+  return false;
+}
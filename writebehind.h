@@ -0,0 +1,88 @@
+/*
+ *   Copyright 2014 Google, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef WRITEBEHIND_H
+#define WRITEBEHIND_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include "base.h"
+#include "sqlite3.h"
+
+// WriteBehind applies database writes that nobody waits on (playcount
+// bumps, playlist locks) from a thread of its own, on its own connection,
+// so that a slow disk never holds up the start of the next track.  Pending
+// writes are coalesced: any number of bumps to one item become a single
+// UPDATE, and a playlist is only ever locked once.  Everything queued is
+// written before the destructor returns.
+//
+// Like AutomationState, there is at most one instance, which registers
+// itself on construction; callers use get() and write synchronously
+// themselves if it returns NULL (as in acmd).
+class WriteBehind {
+ public:
+  // Takes ownership of db.  At most capacity distinct writes may be pending;
+  // beyond that, callers block until the writer catches up.
+  WriteBehind(sqlite3 *db, size_t capacity);
+  ~WriteBehind();
+
+  static WriteBehind *get() { return instance_; }
+
+  void IncrementPlaycount(sqlite3_int64 playableitemid);
+  void LockPlaylist(const std::string& name);
+
+  // For exit paths that skip the destructor: writes everything queued and
+  // stops the writer, as the destructor would, but waits no longer than
+  // timeout.  Returns false if writes were still pending.  Never call it
+  // from a signal handler.
+  bool Flush(const boost::posix_time::time_duration& timeout);
+
+ private:
+  typedef std::map<sqlite3_int64, int> PlaycountMap;
+  typedef std::set<std::string> NameSet;
+
+  void Run();
+  bool WriteBatch(const PlaycountMap& playcounts, const NameSet& locks);
+  size_t pending_locked() const { return playcounts_.size() + locks_.size(); }
+  void WaitForRoom(boost::mutex::scoped_lock *lock);
+
+  static WriteBehind *instance_;
+
+  sqlite3 *db_;
+  const size_t capacity_;
+  sqlite3_stmt *playcount_;
+  sqlite3_stmt *lock_;
+
+  // mutex_ guards everything below.
+  boost::mutex mutex_;
+  boost::condition_variable work_;   // Signalled when writes are queued.
+  boost::condition_variable idle_;   // Signalled when a batch is done.
+  PlaycountMap playcounts_;
+  NameSet locks_;
+  NameSet locked_;                   // Names already written.
+  bool writing_;
+  bool stopping_;
+
+  boost::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(WriteBehind);
+};
+
+#endif